@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "atomic_output.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+static unsigned int temp_counter;       //Keeps the names of concurrent conversions of the service apart
+
+
+//Builds "<name>.tmp.<pid>.<n>" next to name
+static int make_temp_name (atomic_output *output)
+{
+    unsigned int n = __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED);
+    int length = snprintf(output->temp_name, sizeof(output->temp_name), "%s.tmp.%ld.%u", output->name, (long)getpid(), n);
+    if (length < 0 || length >= (int)sizeof(output->temp_name)) {
+        error("Output file name is too long: %s", output->name);
+        output->temp_name[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+
+//Opens the directory name is in
+static int open_directory (const char *name, int flags)
+{
+    char directory[PATH_MAX];
+    const char *slash = strrchr(name, '/');
+    if (slash == NULL)
+        return open(".", flags | O_CLOEXEC, 0666);
+    if (slash - name >= (long)sizeof(directory))
+        return -1;
+    memcpy(directory, name, slash - name);
+    directory[slash == name ? 1 : slash - name] = '\0';
+    return open(directory, flags | O_CLOEXEC, 0666);
+}
+
+
+#ifdef O_TMPFILE
+static int open_unnamed (const atomic_output *output)
+{
+    return open_directory(output->name, O_TMPFILE | O_RDWR);
+}
+#endif
+
+
+//The rename itself is durable only once the directory is on disk
+static int sync_directory (const char *name)
+{
+    int fd = open_directory(name, O_RDONLY | O_DIRECTORY), failed;
+    if (fd < 0)
+        return -1;
+    failed = fsync(fd) != 0;
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+
+int atomic_output_open (atomic_output *output, const char *name, unsigned long long size, int flags)
+{
+    int fd = -1;
+    output->name = name;
+    output->temp_name[0] = '\0';
+    output->passed = 0;
+#ifdef O_TMPFILE
+    if (!(flags & ATOMIC_OUTPUT_NAMED))
+        fd = open_unnamed(output);
+#endif
+    //Older kernels and some file systems have no O_TMPFILE
+    if (fd < 0) {
+        if (make_temp_name(output))
+            return -1;
+        fd = open(output->temp_name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) {
+        error("Can not create %s", name);
+        output->temp_name[0] = '\0';
+        return -1;
+    }
+    //Only a hint: file systems without fallocate just grow the file while it is written
+    if (size != 0 && fallocate(fd, 0, 0, (off_t)size) && errno != EOPNOTSUPP && errno != ENOSYS) {
+        error("Can not allocate %llu bytes for %s", size, name);
+        close(fd);
+        if (output->temp_name[0] != '\0')
+            unlink(output->temp_name);
+        return -1;
+    }
+    if ((output->file = fdopen(fd, "w+b")) == NULL) {
+        error("Can not create %s", name);
+        close(fd);
+        if (output->temp_name[0] != '\0')
+            unlink(output->temp_name);
+        return -1;
+    }
+    return 0;
+}
+
+
+int atomic_output_open_passed (atomic_output *output, int fd, const char *name, unsigned long long size)
+{
+    int flags = fcntl(fd, F_GETFL), copy;
+    output->name = name;
+    output->temp_name[0] = '\0';
+    output->passed = 1;
+    output->size = size;
+    //The copy is closed with the stream, the service closes the passed descriptor itself
+    if (flags < 0 || (copy = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        error("Can not create %s", name);
+        return -1;
+    }
+    if ((output->file = fdopen(copy, (flags & O_ACCMODE) == O_RDWR ? "r+b" : "wb")) == NULL) {
+        error("Can not create %s", name);
+        close(copy);
+        return -1;
+    }
+    return 0;
+}
+
+
+int atomic_output_commit (atomic_output *output)
+{
+    char fd_path[64];
+    int failed = fflush(output->file) != 0;
+    off_t end;
+    if (output->passed) {
+        //The old contents past the image are cut off only now, the request has succeeded
+        end = output->size ? (off_t)output->size : ftello(output->file);
+        if (!failed)
+            failed = end < 0 || ftruncate(fileno(output->file), end) != 0;
+        if (fclose(output->file) || failed) {
+            error("Data writing error");
+            return -1;
+        }
+        return 0;
+    }
+    //The data goes to disk before the file gets the name, or a crash could leave the target empty or cut short
+    failed = failed || fsync(fileno(output->file)) != 0;
+    if (!failed && output->temp_name[0] == '\0') {
+        //An O_TMPFILE file gets a temporary name first, linkat can not replace an existing target
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fileno(output->file));
+        failed = make_temp_name(output) || linkat(AT_FDCWD, fd_path, AT_FDCWD, output->temp_name, AT_SYMLINK_FOLLOW);
+        if (failed && output->temp_name[0] != '\0') {
+            error("Can not create %s", output->name);
+            output->temp_name[0] = '\0';
+        }
+    }
+    else if (failed)
+        error("Data writing error");
+    if (fclose(output->file) && !failed) {
+        error("Data writing error");
+        failed = 1;
+    }
+    if (!failed && rename(output->temp_name, output->name)) {
+        error("Can not create %s", output->name);
+        failed = 1;
+    }
+    if (failed && output->temp_name[0] != '\0')
+        unlink(output->temp_name);
+    if (!failed && sync_directory(output->name)) {
+        error("Can not sync the directory of %s", output->name);
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+
+void atomic_output_abort (atomic_output *output)
+{
+    fclose(output->file);
+    if (output->temp_name[0] != '\0')
+        unlink(output->temp_name);
+}
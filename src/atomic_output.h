@@ -0,0 +1,34 @@
+#ifndef ATOMIC_OUTPUT_H
+#define ATOMIC_OUTPUT_H
+
+#include <stdio.h>
+#include <limits.h>
+
+//Flags of atomic_output_open
+#define ATOMIC_OUTPUT_NAMED     1       //Use a temporary name even where O_TMPFILE works, for writers that need a path
+
+//Output file that appears under its name only once it is complete. It is written as an unnamed O_TMPFILE
+//in the target directory (or under a temporary name where O_TMPFILE is not supported) and renamed over
+//the target on commit, so readers never see a half-written image and a failed conversion leaves nothing behind.
+typedef struct {
+    FILE *file;
+    const char *name;
+    char temp_name[PATH_MAX];       //Empty while the file has no name yet
+    int passed;     //Written in place into a descriptor passed by a client of the service, nothing is renamed
+    unsigned long long size;        //Of a passed output, 0 when it ends at the position of the stream
+} atomic_output;
+
+//Creates the file that will replace name. When size is not 0 it is allocated up front,
+//so the output does not grow in small steps and fragment. Returns 0, or -1 after printing what is wrong.
+int atomic_output_open (atomic_output *output, const char *name, unsigned long long size, int flags);
+//Writes straight into fd, an output opened by a client of the service: the server has no path to create
+//a file next to it. The old contents past size (or past the stream when size is 0) are cut off only by
+//the commit, so a request rejected before writing leaves the file as it was.
+//fd stays open. Returns 0, or -1 after printing what is wrong.
+int atomic_output_open_passed (atomic_output *output, int fd, const char *name, unsigned long long size);
+//Flushes, closes and moves the file into place. Returns 0, or -1 after printing what is wrong.
+int atomic_output_commit (atomic_output *output);
+//Closes and removes the file, the target is left as it was
+void atomic_output_abort (atomic_output *output);
+
+#endif
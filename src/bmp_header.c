@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_header.h"
+#include "bmpneg.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+
+int read_and_check_header (uint32_t *header, FILE *input_file, const char *file_name)
+{
+    long long real_file_size;
+    uint8_t header_bytes[HEADER_SIZE];
+    size_t header_size;
+    const char *message;
+    bmpneg_status status;
+    if (fseek(input_file, 0, SEEK_END)) {
+        error("fseek() error. File: %s", file_name);
+        return -1;
+    }
+    real_file_size = ftell(input_file);
+    if (real_file_size == -1L) {
+        error("ftell() error. File: %s", file_name);
+        return -1;
+    }
+    if (fseek(input_file, 0, SEEK_SET)) {
+        error("fseek() error. File: %s", file_name);
+        return -1;
+    }
+    header_size = fread(header_bytes, sizeof(uint8_t), HEADER_SIZE, input_file);
+    if (header_size != HEADER_SIZE && ferror(input_file)) {
+        error("File read error. File: %s", file_name);
+        return -1;
+    }
+    if ((status = bmpneg_check_header(header_bytes, header_size, real_file_size, &message)) != BMPNEG_OK) {
+        error("%s File: %s", message, file_name);
+        return status;
+    }
+    memcpy(header, header_bytes + 2, sizeof(uint32_t) * HEADER_CELLS);
+    return 0;
+}
+
+
+int parse_region (const char *text, bmp_region *region)
+{
+    unsigned int values[4];
+    unsigned long value;
+    char *end;
+    for (int i = 0; i < 4; i++) {
+        value = strtoul(text, &end, 10);
+        if (end == text || *text == '-' || value > 0x7fffffff || *end != (i == 3 ? '\0' : ',')) {
+            error("A region is given as x,y,width,height with non-negative numbers\n");
+            return -1;
+        }
+        values[i] = (unsigned int)value;
+        text = end + 1;
+    }
+    region->x = values[0];
+    region->y = values[1];
+    region->width = values[2];
+    region->height = values[3];
+    return 0;
+}
+
+
+int clip_region (bmp_region *region, const uint32_t *header)
+{
+    unsigned int width = header[WIDTH_A], rows = abs((signed)header[HEIGHT_A]);
+    if (region->x >= width || region->y >= rows || region->width == 0 || region->height == 0)
+        return 0;
+    if (region->width > width - region->x)
+        region->width = width - region->x;
+    if (region->height > rows - region->y)
+        region->height = rows - region->y;
+    return 1;
+}
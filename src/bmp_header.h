@@ -0,0 +1,39 @@
+#ifndef BMP_HEADER_H
+#define BMP_HEADER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+//All macros marked A means the address of the parameter from the header in the array
+#define FILE_SIZE_A     0
+#define RESERVED_FIELDS_A     1
+#define PIXEL_ARRAY_ADDRESS_A     2
+#define DIB_HEADER_SIZE_A     3
+#define WIDTH_A     4
+#define HEIGHT_A     5
+#define FORMAT_A     6
+#define COMPRESSION_A     7
+#define IMAGE_SIZE_A     8
+#define NUMBER_OF_COLORS_IN_PALETTE_A     11
+
+#define HEADER_SIZE 0x36
+#define HEADER_CELLS 13     //13 is the number of 4 bit cells in an array that contains the header data
+
+//Rectangle of an image in image coordinates: x from the left, y from the top row
+typedef struct {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+} bmp_region;
+
+//Parses "x,y,w,h". Returns 0, or -1 after printing what is wrong.
+int parse_region (const char *text, bmp_region *region);
+//Cuts region down to the image described by header. Returns 0 when nothing of it is left.
+int clip_region (bmp_region *region, const uint32_t *header);
+
+//Reads the header of file_name into header and checks that the image is a supported
+//uncompressed 8-bit or 24-bit BMP. Returns 0, -1 for I/O and unsupported files, -2 for broken structure.
+int read_and_check_header (uint32_t *header, FILE *input_file, const char *file_name);
+
+#endif
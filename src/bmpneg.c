@@ -0,0 +1,263 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_header.h"
+#include "bmpneg.h"
+#include "row_kernels.h"
+
+
+static bmpneg_status fail (bmpneg_status status, const char *text, const char **message)
+{
+    if (message != NULL)
+        *message = text;
+    return status;
+}
+
+
+bmpneg_status bmpneg_check_header (const uint8_t *header_bytes, size_t header_size,
+                                   unsigned long long file_size, const char **message)
+{
+    uint32_t header[HEADER_CELLS];
+    unsigned long long bytes_in_pixel_arr, bytes_in_row, rows;
+    if (header_bytes == NULL || header_size < 2)
+        return fail(BMPNEG_ERROR, "Incorrect file. Empty file.", message);
+    if (header_bytes[0] != 'B' || header_bytes[1] != 'M')
+        return fail(BMPNEG_ERROR, "Unsupported format.", message);
+    if (header_size < HEADER_SIZE)
+        return fail(BMPNEG_ERROR, "Unsupported format.", message);
+    memcpy(header, header_bytes + 2, sizeof(header));
+    if (file_size != header[FILE_SIZE_A])
+        return fail(BMPNEG_INVALID_STRUCTURE, "Size data from metadata does not match the actual size.", message);
+    if (header[RESERVED_FIELDS_A] != 0)
+        return fail(BMPNEG_INVALID_STRUCTURE, "Reserved fields should be equal to 0.", message);
+    if (header[DIB_HEADER_SIZE_A] != 40)
+        return fail(BMPNEG_INVALID_STRUCTURE, "Unsupported format. Only images with BITMAPINFOHEADER header name are supported.", message);
+    if ((header[FORMAT_A] << 16) != 0x10000)    //In one cell was written two 2bit values. that check their separate and used a bit shift.
+        return fail(BMPNEG_INVALID_STRUCTURE, "The number of color planes should be 1.", message);
+    if (((header[FORMAT_A] >> 16) != 24) && ((header[FORMAT_A] >> 16) != 8))
+        return fail(BMPNEG_INVALID_STRUCTURE, "Unsupported format. Only 8-bit and 24-bit images are supported.", message);
+    if (header[COMPRESSION_A] != 0)
+        return fail(BMPNEG_INVALID_STRUCTURE, "Support only uncompressed images.", message);
+    if (((header[FORMAT_A] >> 16) == 8) && (header[NUMBER_OF_COLORS_IN_PALETTE_A] > 256))
+        return fail(BMPNEG_INVALID_STRUCTURE, "Number of colors may not exceed 256.", message);
+    if (header[PIXEL_ARRAY_ADDRESS_A] < HEADER_SIZE || header[PIXEL_ARRAY_ADDRESS_A] > file_size)
+        return fail(BMPNEG_INVALID_STRUCTURE, "The pixel array address points outside of the image data.", message);
+    //Sizes are checked by division, so huge widths from a crafted header can not wrap around
+    bytes_in_pixel_arr = file_size - header[PIXEL_ARRAY_ADDRESS_A];
+    rows = llabs((long long)(int32_t)header[HEIGHT_A]);
+    if ((header[FORMAT_A] >> 16) == 24)
+        bytes_in_row = header[WIDTH_A] % 4 + (unsigned long long)header[WIDTH_A] * 3;
+    else
+        bytes_in_row = (4 - header[WIDTH_A] % 4) % 4 + (unsigned long long)header[WIDTH_A];
+    if (rows == 0 ? bytes_in_pixel_arr != 0 : bytes_in_pixel_arr % rows != 0 || bytes_in_pixel_arr / rows != bytes_in_row)
+        return fail(BMPNEG_INVALID_STRUCTURE, "The size of the character array does not coincide with the size specified in the header.", message);
+    if ((header[FORMAT_A] >> 16) == 8 &&
+        (header[NUMBER_OF_COLORS_IN_PALETTE_A] * 4 != (header[PIXEL_ARRAY_ADDRESS_A] - HEADER_SIZE)))
+        return fail(BMPNEG_INVALID_STRUCTURE, "The size of the palette array does not coincide with the size specified in the header.", message);
+    return fail(BMPNEG_OK, "", message);
+}
+
+
+bmpneg_status bmpneg_check (const uint8_t *buffer, size_t size, const char **message)
+{
+    return bmpneg_check_header(buffer, size, size, message);
+}
+
+
+void bmpneg_lut_identity (bmpneg_lut *lut)
+{
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            lut->channel[c][v] = v;
+}
+
+
+void bmpneg_lut_invert_channels (bmpneg_lut *lut, int channels)
+{
+    for (int c = 0; c < 3; c++)
+        if (channels & (1 << c))
+            for (int v = 0; v < 256; v++)
+                lut->channel[c][v] = ~lut->channel[c][v];
+}
+
+
+void bmpneg_lut_negate (bmpneg_lut *lut)
+{
+    bmpneg_lut_invert_channels(lut, BMPNEG_BLUE | BMPNEG_GREEN | BMPNEG_RED);
+}
+
+
+//Applies the same mapping of values to all channels
+static void lut_map (bmpneg_lut *lut, const uint8_t *map)
+{
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            lut->channel[c][v] = map[lut->channel[c][v]];
+}
+
+
+void bmpneg_lut_brightness (bmpneg_lut *lut, int delta)
+{
+    uint8_t map[256];
+    for (int v = 0; v < 256; v++)
+        map[v] = v + delta < 0 ? 0 : v + delta > 255 ? 255 : v + delta;
+    lut_map(lut, map);
+}
+
+
+void bmpneg_lut_gamma (bmpneg_lut *lut, double gamma)
+{
+    uint8_t map[256];
+    for (int v = 0; v < 256; v++)
+        map[v] = (uint8_t)(255.0 * pow(v / 255.0, 1.0 / gamma) + 0.5);
+    lut_map(lut, map);
+}
+
+
+void bmpneg_lut_threshold (bmpneg_lut *lut, uint8_t level)
+{
+    uint8_t map[256];
+    for (int v = 0; v < 256; v++)
+        map[v] = v >= level ? 255 : 0;
+    lut_map(lut, map);
+}
+
+
+void bmpneg_lut_posterize (bmpneg_lut *lut, unsigned int levels)
+{
+    uint8_t map[256];
+    unsigned int steps = levels - 1;
+    for (unsigned int v = 0; v < 256; v++)
+        map[v] = (v * steps + 127) / 255 * 255 / steps;
+    lut_map(lut, map);
+}
+
+
+//Tables that only flip bits (identity, negative, inversion of some channels) are v ^ key per channel.
+//Those are applied with a plain xor, which the compiler vectorizes, instead of lookups.
+static int lut_xor_key (const bmpneg_lut *lut, uint8_t *key)
+{
+    for (int c = 0; c < 3; c++) {
+        key[c] = lut->channel[c][0];
+        for (int v = 1; v < 256; v++)
+            if (lut->channel[c][v] != (uint8_t)(v ^ key[c]))
+                return 0;
+    }
+    return 1;
+}
+
+
+void bmpneg_lut_apply_palette (uint8_t *palette, unsigned int colors, const bmpneg_lut *lut)
+{
+    //Only the palette is remapped, the pixels keep their indexes
+    for (unsigned int i = 0; i < colors * 4; i += 4) {
+        palette[i] = lut->channel[0][palette[i]];//b
+        palette[i + 1] = lut->channel[1][palette[i + 1]];//g
+        palette[i + 2] = lut->channel[2][palette[i + 2]];//r
+    }
+}
+
+
+#define XOR_BLOCK     48     //16 pixels, the smallest block that holds whole pixels and whole 16-byte vectors
+
+typedef struct {
+    const bmpneg_lut *lut;
+    uint8_t pattern[XOR_BLOCK];
+} lut_job;
+
+
+static inline int xor_row_24 (uint8_t *row, unsigned int width, void *context)
+{
+    const uint8_t *pattern = ((lut_job *)context)->pattern;
+    size_t bytes_in_row = (size_t)width * 3, i;
+    for (i = 0; i + XOR_BLOCK <= bytes_in_row; i += XOR_BLOCK)
+        for (int k = 0; k < XOR_BLOCK; k++)
+            row[i + k] ^= pattern[k];
+    for (; i < bytes_in_row; i++)
+        row[i] ^= pattern[i % 3];
+    return 0;
+}
+
+
+static inline int lut_row_24 (uint8_t *row, unsigned int width, void *context)
+{
+    const bmpneg_lut *lut = ((lut_job *)context)->lut;
+    const uint8_t *blue = lut->channel[0], *green = lut->channel[1], *red = lut->channel[2];
+    for (unsigned int x = 0; x < width; x++, row += 3) {
+        row[0] = blue[row[0]];
+        row[1] = green[row[1]];
+        row[2] = red[row[2]];
+    }
+    return 0;
+}
+
+
+//8-bit images are converted through their palette, so only 24-bit rows have kernels
+DEFINE_CONVERT_ROW_KERNELS(xor_row, 24)
+DEFINE_CONVERT_ROW_KERNELS(lut_row, 24)
+
+static const convert_row_kernel xor_row_kernels[4] = CONVERT_ROW_KERNEL_TABLE(xor_row, 24);
+static const convert_row_kernel lut_row_kernels[4] = CONVERT_ROW_KERNEL_TABLE(lut_row, 24);
+
+
+void bmpneg_lut_apply_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width, const bmpneg_lut *lut)
+{
+    lut_job job;
+    uint8_t key[3];
+    job.lut = lut;
+    if (lut_xor_key(lut, key)) {
+        for (int i = 0; i < XOR_BLOCK; i++)
+            job.pattern[i] = key[i % 3];
+        xor_row_kernels[width % 4](rows, count, width, &job);
+    }
+    else
+        lut_row_kernels[width % 4](rows, count, width, &job);
+}
+
+
+void bmpneg_invert_palette (uint8_t *palette, unsigned int colors)
+{
+    bmpneg_lut lut;
+    bmpneg_lut_identity(&lut);
+    bmpneg_lut_negate(&lut);
+    bmpneg_lut_apply_palette(palette, colors, &lut);
+}
+
+
+void bmpneg_invert_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width)
+{
+    bmpneg_lut lut;
+    bmpneg_lut_identity(&lut);
+    bmpneg_lut_negate(&lut);
+    bmpneg_lut_apply_24bit_rows(rows, count, width, &lut);
+}
+
+
+bmpneg_status bmpneg_transform (const uint8_t *input, uint8_t *output, size_t size,
+                                const bmpneg_lut *lut, const char **message)
+{
+    uint32_t header[HEADER_CELLS];
+    bmpneg_status status;
+    if (output == NULL || lut == NULL)
+        return fail(BMPNEG_ERROR, "No output buffer or lookup table.", message);
+    if ((status = bmpneg_check(input, size, message)) != BMPNEG_OK)
+        return status;
+    memcpy(header, input + 2, sizeof(header));
+    if (output != input)
+        memcpy(output, input, size);
+    if ((header[FORMAT_A] >> 16) == 8)
+        bmpneg_lut_apply_palette(output + HEADER_SIZE, header[NUMBER_OF_COLORS_IN_PALETTE_A], lut);
+    else
+        bmpneg_lut_apply_24bit_rows(output + header[PIXEL_ARRAY_ADDRESS_A], llabs((long long)(int32_t)header[HEIGHT_A]),
+                                    header[WIDTH_A], lut);
+    return BMPNEG_OK;
+}
+
+
+bmpneg_status bmpneg_convert (const uint8_t *input, uint8_t *output, size_t size, const char **message)
+{
+    bmpneg_lut lut;
+    bmpneg_lut_identity(&lut);
+    bmpneg_lut_negate(&lut);
+    return bmpneg_transform(input, output, size, &lut, message);
+}
@@ -0,0 +1,86 @@
+#ifndef BMPNEG_H
+#define BMPNEG_H
+
+//libbmpneg - the --mine negative conversion of uncompressed 8-bit and 24-bit BMP v3 images
+//as a library working on memory buffers. Nothing is printed: every call returns a status
+//and, when message is not NULL, points it to a static description of the problem.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(BMPNEG_BUILD) && defined(__GNUC__)
+#define BMPNEG_API __attribute__((visibility("default")))
+#else
+#define BMPNEG_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BMPNEG_VERSION_MAJOR     1
+#define BMPNEG_VERSION_MINOR     0
+
+//The values are the exit codes of converter --mine
+typedef enum {
+    BMPNEG_OK = 0,
+    BMPNEG_ERROR = -1,              //Unsupported image or an error not related to the structure of the format
+    BMPNEG_INVALID_STRUCTURE = -2   //The structure of the image is broken
+} bmpneg_status;
+
+//Checks the first header_size bytes of an image whose whole size is file_size (the header must be
+//complete: 0x36 bytes). Lets streaming callers validate an image before reading its pixels.
+BMPNEG_API bmpneg_status bmpneg_check_header (const uint8_t *header, size_t header_size,
+                                              unsigned long long file_size, const char **message);
+
+//Checks that buffer holds a complete supported image.
+BMPNEG_API bmpneg_status bmpneg_check (const uint8_t *buffer, size_t size, const char **message);
+
+//Writes the negative of the image in input to output, which must hold size bytes and may be input itself.
+//output is left untouched when the image is rejected.
+BMPNEG_API bmpneg_status bmpneg_convert (const uint8_t *input, uint8_t *output, size_t size, const char **message);
+
+//Per-channel lookup table. Every color byte v of channel c becomes channel[c][v].
+//Channels are indexed by their position in a pixel (the file stores colors as blue, green, red).
+typedef struct {
+    uint8_t channel[3][256];
+} bmpneg_lut;
+
+#define BMPNEG_BLUE     1
+#define BMPNEG_GREEN     2
+#define BMPNEG_RED     4
+
+//Table builders. bmpneg_lut_identity starts a table, the others append an operation to it,
+//so a chain of calls describes the operations applied in the same order.
+BMPNEG_API void bmpneg_lut_identity (bmpneg_lut *lut);
+BMPNEG_API void bmpneg_lut_negate (bmpneg_lut *lut);
+//channels is a combination of BMPNEG_BLUE, BMPNEG_GREEN and BMPNEG_RED
+BMPNEG_API void bmpneg_lut_invert_channels (bmpneg_lut *lut, int channels);
+//Adds delta (-255..255) and saturates
+BMPNEG_API void bmpneg_lut_brightness (bmpneg_lut *lut, int delta);
+//v = 255 * (v / 255) ^ (1 / gamma), gamma > 0
+BMPNEG_API void bmpneg_lut_gamma (bmpneg_lut *lut, double gamma);
+//v = v >= level ? 255 : 0
+BMPNEG_API void bmpneg_lut_threshold (bmpneg_lut *lut, uint8_t level);
+//Rounds to one of levels (2..256) evenly spaced values
+BMPNEG_API void bmpneg_lut_posterize (bmpneg_lut *lut, unsigned int levels);
+
+//Like bmpneg_convert, but applies lut instead of the negative: to the palette of 8-bit images
+//and to every pixel of 24-bit ones.
+BMPNEG_API bmpneg_status bmpneg_transform (const uint8_t *input, uint8_t *output, size_t size,
+                                           const bmpneg_lut *lut, const char **message);
+
+//Building blocks for callers that stream the image themselves.
+BMPNEG_API void bmpneg_lut_apply_palette (uint8_t *palette, unsigned int colors, const bmpneg_lut *lut);
+BMPNEG_API void bmpneg_lut_apply_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width,
+                                             const bmpneg_lut *lut);
+//Inverts the colors of a palette of 4-byte entries, leaving the reserved bytes alone.
+BMPNEG_API void bmpneg_invert_palette (uint8_t *palette, unsigned int colors);
+//Inverts rows of a 24-bit pixel array, skipping the padding to the 4-byte boundary.
+BMPNEG_API void bmpneg_invert_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
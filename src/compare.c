@@ -0,0 +1,983 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bmp_header.h"
+#include "compare.h"
+#include "image_index.h"
+#include "paired_reader.h"
+#include "perf_counters.h"
+#include "row_kernels.h"
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define COMPARE_BAND_BYTES     (1 << 20)
+#define REPORTED_MISMATCHES     100     //Default of --max-diffs
+#define NEAR_DISTANCE     10      //Default of --max-distance
+#define NEAR_DIFFERING     5       //Default of --max-differing
+#define REPORT_FIRST_CAPACITY     1024
+#define REPORT_MAGIC     "BMPD"
+#define REPORT_VERSION     1
+#define QUICK_SAMPLE_ROWS     64    //Strata of the row sample checked first by --quick
+#define SSD_LANES     48     //16 pixels, whole pixels in whole 16-byte vectors
+#define SSD_BLOCKS     65536    //Blocks a 32-bit lane can sum without overflowing: 65536 * 255 * 255 < 2^32
+
+typedef struct {
+    uint32_t key;   //Xored into the first color: 0 when the colors must be equal, 0xffffff for complements
+    uint32_t first_palette[256];    //8-bit images: colors as 0xRRGGBB, the entries past the palette are zero
+    uint32_t second_palette[256];
+    unsigned int first_colors;
+    unsigned int second_colors;
+    unsigned int tolerance;     //Largest channel difference of matching pixels
+    int measure;    //Compare with the tolerance and collect the metrics instead of checking for equality
+    int stop_at_first;      //--quick: the kernels stop after the row with the first difference
+    unsigned int x_offset;      //Column of the first pixel of the rows given to the kernels
+    const uint8_t *mask;    //--mask: 0xff for every byte of the selected pixels of the row, 0 for the rest
+    long long max_reported;
+    long long reported;
+    long long capacity;
+    uint32_t *coordinates;      //x, y of the first max_reported mismatches
+    long long mismatches;
+    unsigned long long pixels;      //Pixels the metrics are averaged over
+    unsigned long long squares[3];      //Sums of squared differences per channel: blue, green, red
+    unsigned int max_delta[3];
+    long long channel_mismatches[3];
+} compare_job;
+
+
+//The report only grows as far as the mismatches found, so a large --max-diffs costs nothing up front
+static int grow_report (compare_job *job)
+{
+    long long capacity = job->capacity ? 2 * job->capacity : REPORT_FIRST_CAPACITY;
+    uint32_t *coordinates;
+    if (capacity > job->max_reported)
+        capacity = job->max_reported;
+    if ((coordinates = realloc(job->coordinates, 2 * sizeof(uint32_t) * capacity)) == NULL) {
+        error("Memory allocation error. Only %lld mismatches are reported.\n", job->reported);
+        job->max_reported = job->reported;
+        return 0;
+    }
+    job->coordinates = coordinates;
+    job->capacity = capacity;
+    return 1;
+}
+
+
+static void report_mismatch (compare_job *job, unsigned int x, unsigned int y)
+{
+    if (job->mismatches < job->max_reported && (job->reported < job->capacity || grow_report(job))) {
+        job->coordinates[2 * job->reported] = job->x_offset + x;
+        job->coordinates[2 * job->reported + 1] = y;
+        job->reported++;
+    }
+    job->mismatches++;
+}
+
+
+//Once the report is full the differing pixels of a row are only counted, without branches
+static inline unsigned int count_mismatches_24 (const uint8_t *first, const uint8_t *second, const uint8_t *mask,
+                                                unsigned int width, uint8_t key)
+{
+    unsigned int count = 0;
+    for (unsigned int x = 0; x < width; x++, first += 3, second += 3)
+        count += (((first[0] ^ second[0] ^ key) | (first[1] ^ second[1] ^ key) | (first[2] ^ second[2] ^ key)) &
+                  (mask != NULL ? mask[x * 3] : 0xff)) != 0;
+    return count;
+}
+
+
+//Counts the channels of one pixel that differ by more than the tolerance
+static void measure_pixel (compare_job *job, const int *delta, unsigned int x, unsigned int y)
+{
+    int differs = 0;
+    for (int c = 0; c < 3; c++) {
+        if ((unsigned int)abs(delta[c]) > job->tolerance) {
+            job->channel_mismatches[c]++;
+            differs = 1;
+        }
+    }
+    if (differs)
+        report_mismatch(job, x, y);
+}
+
+
+//Sum of squared differences and the largest difference of a row, lane by lane. Lane k always holds
+//channel k % 3, so the fixed-size inner loop is turned into vector instructions by the compiler.
+//It is inlined with mask == NULL and with a mask, so the unmasked loop does not test the mask at all.
+static inline void measure_row_24 (const uint8_t *first, const uint8_t *second, const uint8_t *mask,
+                                   unsigned int width, unsigned int y, compare_job *job)
+{
+    size_t bytes_in_row = (size_t)width * 3, i = 0, blocks;
+    uint32_t squares[SSD_LANES];
+    uint8_t key = (uint8_t)job->key, max_delta[SSD_LANES];
+    unsigned int row_max = 0;
+    int delta[3];
+    memset(max_delta, 0, sizeof(max_delta));
+    while (i + SSD_LANES <= bytes_in_row) {
+        memset(squares, 0, sizeof(squares));
+        for (blocks = 0; blocks < SSD_BLOCKS && i + SSD_LANES <= bytes_in_row; blocks++, i += SSD_LANES) {
+            for (int k = 0; k < SSD_LANES; k++) {
+                int d = (uint8_t)(first[i + k] ^ key) - second[i + k];
+                uint8_t a;
+                if (mask != NULL)
+                    d = mask[i + k] ? d : 0;
+                a = d < 0 ? -d : d;
+                squares[k] += (uint32_t)(d * d);
+                max_delta[k] = a > max_delta[k] ? a : max_delta[k];
+            }
+        }
+        for (int k = 0; k < SSD_LANES; k++)
+            job->squares[k % 3] += squares[k];
+    }
+    for (; i < bytes_in_row; i++) {
+        int d = (uint8_t)(first[i] ^ key) - second[i];
+        uint8_t a;
+        if (mask != NULL)
+            d = mask[i] ? d : 0;
+        a = d < 0 ? -d : d;
+        job->squares[i % 3] += (uint32_t)(d * d);
+        max_delta[i % 3] = a > max_delta[i % 3] ? a : max_delta[i % 3];
+    }
+    for (int k = 0; k < SSD_LANES; k++) {
+        if (max_delta[k] > job->max_delta[k % 3])
+            job->max_delta[k % 3] = max_delta[k];
+        if (max_delta[k] > row_max)
+            row_max = max_delta[k];
+    }
+    if (row_max > job->tolerance) {
+        for (unsigned int x = 0; x < width; x++, first += 3, second += 3) {
+            if (mask != NULL && !mask[x * 3])
+                continue;
+            for (int c = 0; c < 3; c++)
+                delta[c] = (uint8_t)(first[c] ^ key) - second[c];
+            measure_pixel(job, delta, x, y);
+        }
+    }
+}
+
+
+//The rows are first checked as a whole without branches, the pixels are only visited when a row differs
+static inline int compare_row_24 (uint8_t *first, const uint8_t *second, unsigned int width, unsigned int y, void *context)
+{
+    compare_job *job = context;
+    const uint8_t *mask = job->mask;
+    size_t bytes_in_row = (size_t)width * 3;
+    uint8_t key = (uint8_t)job->key, difference = 0;
+    if (job->measure) {
+        if (mask != NULL)
+            measure_row_24(first, second, mask, width, y, job);
+        else
+            measure_row_24(first, second, NULL, width, y, job);
+        return job->stop_at_first && job->mismatches != 0;
+    }
+    if (mask != NULL) {
+        for (size_t i = 0; i < bytes_in_row; i++)
+            difference |= (first[i] ^ second[i] ^ key) & mask[i];
+    }
+    else {
+        for (size_t i = 0; i < bytes_in_row; i++)
+            difference |= first[i] ^ second[i] ^ key;
+    }
+    if (difference != 0 && job->mismatches >= job->max_reported)
+        job->mismatches += count_mismatches_24(first, second, mask, width, key);
+    else if (difference != 0) {
+        for (unsigned int x = 0; x < width; x++, first += 3, second += 3)
+            if ((mask == NULL || mask[x * 3]) &&
+                ((uint8_t)(first[0] ^ key) != second[0] || (uint8_t)(first[1] ^ key) != second[1] ||
+                 (uint8_t)(first[2] ^ key) != second[2]))
+                report_mismatch(job, x, y);
+    }
+    return job->stop_at_first && job->mismatches != 0;
+}
+
+
+static inline int compare_row_8 (uint8_t *first, const uint8_t *second, unsigned int width, unsigned int y, void *context)
+{
+    compare_job *job = context;
+    const uint8_t *mask = job->mask;
+    uint32_t difference = 0, overflow = 0, first_color, second_color;
+    int delta[3];
+    for (unsigned int x = 0; x < width; x++) {
+        overflow |= (first[x] >= job->first_colors) | (second[x] >= job->second_colors);
+        difference |= (job->first_palette[first[x]] ^ job->second_palette[second[x]] ^ job->key) &
+                      (mask != NULL ? (uint32_t)-(mask[x] & 1) : 0xffffffff);
+    }
+    if (overflow) {
+        error("Address value in a cell of a pixel array does not correspond to the number of colors in the palette (array overflow).");
+        return -1;
+    }
+    if (job->measure) {
+        for (unsigned int x = 0; x < width; x++) {
+            if (mask != NULL && !mask[x])
+                continue;
+            first_color = job->first_palette[first[x]] ^ job->key;
+            second_color = job->second_palette[second[x]];
+            for (int c = 0; c < 3; c++) {
+                delta[c] = (int)(first_color >> 8 * c & 0xff) - (int)(second_color >> 8 * c & 0xff);
+                job->squares[c] += delta[c] * delta[c];
+                if ((unsigned int)abs(delta[c]) > job->max_delta[c])
+                    job->max_delta[c] = abs(delta[c]);
+            }
+            measure_pixel(job, delta, x, y);
+        }
+    }
+    else if (difference != 0 && job->mismatches >= job->max_reported) {
+        for (unsigned int x = 0; x < width; x++)
+            job->mismatches += ((job->first_palette[first[x]] ^ job->key ^ job->second_palette[second[x]]) &
+                                (mask != NULL ? (uint32_t)-(mask[x] & 1) : 0xffffffff)) != 0;
+    }
+    else if (difference != 0) {
+        for (unsigned int x = 0; x < width; x++)
+            if ((mask == NULL || mask[x]) &&
+                (job->first_palette[first[x]] ^ job->key) != job->second_palette[second[x]])
+                report_mismatch(job, x, y);
+    }
+    return job->stop_at_first && job->mismatches != 0;
+}
+
+
+DEFINE_ROW_KERNELS(compare_row, 8)
+DEFINE_ROW_KERNELS(compare_row, 24)
+
+static const row_kernel compare_8bit_kernels[4][2] = ROW_KERNEL_TABLE(compare_row, 8);
+static const row_kernel compare_24bit_kernels[4][2] = ROW_KERNEL_TABLE(compare_row, 24);
+
+
+static void print_psnr (double mse)
+{
+    if (mse == 0)
+        printf(" %10s", "inf");
+    else
+        printf(" %10.2f", 10 * log10(255.0 * 255.0 / mse));
+}
+
+
+static void print_metrics (const compare_job *job, unsigned long long pixels)
+{
+    static const char *channel_names[3] = { "blue", "green", "red" };
+    unsigned long long squares = 0;
+    unsigned int max_delta = 0;
+    double mse;
+    printf("%-8s %14s %10s %10s %14s\n", "channel", "MSE", "PSNR dB", "max delta", "differing");
+    for (int c = 0; c < 3; c++) {
+        mse = pixels ? (double)job->squares[c] / pixels : 0;
+        printf("%-8s %14.4f", channel_names[c], mse);
+        print_psnr(mse);
+        printf(" %10u %14lld\n", job->max_delta[c], job->channel_mismatches[c]);
+        squares += job->squares[c];
+        if (job->max_delta[c] > max_delta)
+            max_delta = job->max_delta[c];
+    }
+    //The differing count of the whole image is in pixels: a pixel differs when any of its channels does
+    mse = pixels ? (double)squares / (3 * pixels) : 0;
+    printf("%-8s %14.4f", "all", mse);
+    print_psnr(mse);
+    printf(" %10u %14lld\n", max_delta, job->mismatches);
+}
+
+
+static int write_all (int fd, const char *data, size_t size)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = write(fd, data, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        data += done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+static char *json_psnr (char *out, double mse)
+{
+    if (mse == 0)
+        return out + sprintf(out, "null");
+    return out + sprintf(out, "%.4f", 10 * log10(255.0 * 255.0 / mse));
+}
+
+
+static char *json_metrics (char *out, const compare_job *job)
+{
+    static const char *channel_names[3] = { "blue", "green", "red" };
+    unsigned long long squares = 0;
+    unsigned int max_delta = 0;
+    double mse;
+    out += sprintf(out, ",\"metrics\":{");
+    for (int c = 0; c < 3; c++) {
+        mse = job->pixels ? (double)job->squares[c] / job->pixels : 0;
+        out += sprintf(out, "\"%s\":{\"mse\":%.6f,\"psnr\":", channel_names[c], mse);
+        out = json_psnr(out, mse);
+        out += sprintf(out, ",\"max_delta\":%u,\"differing\":%lld},", job->max_delta[c], job->channel_mismatches[c]);
+        squares += job->squares[c];
+        if (job->max_delta[c] > max_delta)
+            max_delta = job->max_delta[c];
+    }
+    mse = job->pixels ? (double)squares / (3 * job->pixels) : 0;
+    out += sprintf(out, "\"all\":{\"mse\":%.6f,\"psnr\":", mse);
+    out = json_psnr(out, mse);
+    return out + sprintf(out, ",\"max_delta\":%u,\"differing\":%lld}}", max_delta, job->mismatches);
+}
+
+
+static void put_le (uint8_t *out, unsigned long long value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out[i] = (uint8_t)(value >> 8 * i);
+}
+
+
+//The whole report is formatted in one buffer and written with one call, so it costs nothing while the images
+//are scanned and the reports of concurrent service requests do not interleave
+static int write_report (const compare_job *job, const compare_options *options)
+{
+    //The longest line of a pair is "(4294967295 , 4294967295)\n"
+    size_t size = 32 * (size_t)job->reported + 1024;
+    char *buffer, *out;
+    int fd = STDOUT_FILENO, result;
+    if (options->format == COMPARE_REPORT_TEXT && options->metrics)
+        print_metrics(job, job->pixels);
+    if ((buffer = malloc(size)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    out = buffer;
+    if (options->format == COMPARE_REPORT_TEXT) {
+        fd = STDERR_FILENO;
+        for (long long i = 0; i < job->reported; i++)
+            out += sprintf(out, "(%u , %u)\n", job->coordinates[2 * i], job->coordinates[2 * i + 1]);
+        //--quick stops at the first difference, so its count says nothing
+        if (job->mismatches != 0 && !options->quick)
+            out += sprintf(out, "Differing pixels: %lld\n", job->mismatches);
+    }
+    else if (options->format == COMPARE_REPORT_JSON) {
+        out += sprintf(out, "{\"differing_pixels\":%lld,\"complete\":%s,\"reported\":[", job->mismatches,
+                       options->quick ? "false" : "true");
+        for (long long i = 0; i < job->reported; i++)
+            out += sprintf(out, "%s[%u,%u]", i ? "," : "", job->coordinates[2 * i], job->coordinates[2 * i + 1]);
+        out += sprintf(out, "]");
+        if (options->metrics)
+            out = json_metrics(out, job);
+        out += sprintf(out, "}\n");
+    }
+    else {
+        memcpy(out, REPORT_MAGIC, 4);
+        put_le((uint8_t *)out + 4, REPORT_VERSION, 4);
+        put_le((uint8_t *)out + 8, job->mismatches, 8);
+        put_le((uint8_t *)out + 16, job->reported, 4);
+        out += 20;
+        for (long long i = 0; i < 2 * job->reported; i++, out += 4)
+            put_le((uint8_t *)out, job->coordinates[i], 4);
+    }
+    fflush(stdout);
+    if ((result = write_all(fd, buffer, out - buffer)) != 0)
+        error("Report writing error");
+    free(buffer);
+    return result;
+}
+
+
+static int read_palette (uint32_t *palette, unsigned int colors, FILE *input_file)
+{
+    uint8_t entries[256 * 4];
+    memset(palette, 0, sizeof(uint32_t) * 256);
+    if (fread(entries, sizeof(uint8_t), colors * 4, input_file) != colors * 4) {
+        if (feof(input_file))
+            error("Palette read error. End of file.");
+        else
+            error("Palette read error.");
+        return -1;
+    }
+    for (unsigned int i = 0; i < colors; i++)
+        palette[i] = entries[i * 4] | entries[i * 4 + 1] << 8 | (uint32_t)entries[i * 4 + 2] << 16;
+    return 0;
+}
+
+
+static int pread_row (int fd, uint8_t *row, size_t size, long long offset)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = pread(fd, row, size, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0) {
+            if (done == 0)
+                error("Pixel array read error. End of file.");
+            else
+                error("Pixel array read error.");
+            return -1;
+        }
+        row += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+//--quick: compares one row from each of QUICK_SAMPLE_ROWS strata of the image, read with pread, so images
+//that differ everywhere are rejected after a few rows of I/O. The rows are spread inside their strata by
+//a multiplicative hash, so periodic content does not always put the sample on the same phase.
+//Returns 0 when the sample matches, 1 on the first difference or -1.
+static int compare_row_sample (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header,
+                               FILE *second_input_file, row_kernel kernel, compare_job *job,
+                               uint8_t *first_row, uint8_t *second_row, size_t bytes_in_row, int flipped)
+{
+    unsigned int rows = abs((signed)first_header[HEIGHT_A]), first, size, row, second;
+    int result = 0;
+    for (unsigned int stratum = 0; stratum < QUICK_SAMPLE_ROWS && result == 0; stratum++) {
+        first = (unsigned long long)rows * stratum / QUICK_SAMPLE_ROWS;
+        size = (unsigned long long)rows * (stratum + 1) / QUICK_SAMPLE_ROWS - first;
+        if (size == 0)
+            continue;
+        row = first + (stratum * 2654435761u) % size;
+        second = flipped ? rows - 1 - row : row;
+        if (pread_row(fileno(first_input_file), first_row, bytes_in_row,
+                      first_header[PIXEL_ARRAY_ADDRESS_A] + (long long)row * bytes_in_row) ||
+            pread_row(fileno(second_input_file), second_row, bytes_in_row,
+                      second_header[PIXEL_ARRAY_ADDRESS_A] + (long long)second * bytes_in_row))
+            return -1;
+        result = kernel(first_row, second_row, 0, 1, row, first_header[WIDTH_A], rows, job);
+    }
+    return result;
+}
+
+
+//Streams both pixel arrays band by band, read by the two threads of a paired reader.
+//With --quick a row sample is checked first.
+static int compare_all_rows (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header,
+                             FILE *second_input_file, row_kernel kernel, compare_job *job, int quick)
+{
+    unsigned int width = first_header[WIDTH_A], rows = abs((signed)first_header[HEIGHT_A]), rows_per_band, band_rows;
+    int flipped = ((signed)first_header[HEIGHT_A] < 0) != ((signed)second_header[HEIGHT_A] < 0), result = 0;
+    size_t bytes_in_row = (first_header[FILE_SIZE_A] - first_header[PIXEL_ARRAY_ADDRESS_A]) / rows;
+    uint8_t *first_band, *second_band;
+    const uint8_t *second_rows;
+    paired_reader reader;
+    perf_scope scope;
+    job->pixels = (unsigned long long)width * rows;
+    rows_per_band = COMPARE_BAND_BYTES / bytes_in_row ? COMPARE_BAND_BYTES / bytes_in_row : 1;
+    if (rows_per_band > rows)
+        rows_per_band = rows;
+    //A full scan of a small image costs no more than the sample
+    if (quick && rows > QUICK_SAMPLE_ROWS) {
+        first_band = malloc(bytes_in_row);
+        second_band = malloc(bytes_in_row);
+        if (first_band == NULL || second_band == NULL) {
+            error("Memory allocation error.");
+            result = -1;
+        }
+        else {
+            perf_phase_begin(&scope);
+            result = compare_row_sample(first_header, first_input_file, second_header, second_input_file, kernel, job,
+                                        first_band, second_band, bytes_in_row, flipped);
+            perf_phase_end(&scope, PERF_PIXEL_READ, 2 * QUICK_SAMPLE_ROWS * bytes_in_row);
+        }
+        free(first_band);
+        free(second_band);
+        if (result != 0)
+            return result;
+    }
+    //When the row orders differ, the matching rows of the second image are read from its other end
+    if (paired_reader_start(&reader, fileno(first_input_file), first_header[PIXEL_ARRAY_ADDRESS_A],
+                            fileno(second_input_file), second_header[PIXEL_ARRAY_ADDRESS_A], flipped, bytes_in_row,
+                            rows, rows_per_band))
+        return -1;
+    for (unsigned int y = 0; y < rows && result == 0; y += band_rows) {
+        if (paired_reader_next(&reader, &first_band, &second_band, &band_rows)) {
+            result = -1;
+            break;
+        }
+        second_rows = flipped ? second_band + (band_rows - 1) * bytes_in_row : second_band;
+        perf_phase_begin(&scope);
+        result = kernel(first_band, second_rows, flipped ? -(long)bytes_in_row : (long)bytes_in_row,
+                        band_rows, y, width, rows, job);
+        perf_phase_end(&scope, PERF_TRANSFORM, 2 * band_rows * bytes_in_row);
+        paired_reader_release(&reader);
+    }
+    paired_reader_stop(&reader);
+    return result;
+}
+
+
+//--mask: an 8-bit or 24-bit image of the size of the compared ones, its pixels that are not black are compared
+typedef struct {
+    FILE *file;
+    uint32_t header[HEADER_CELLS];
+    uint32_t palette[256];
+    size_t bytes_in_row;
+    uint8_t *row;
+} mask_image;
+
+
+static int open_mask (mask_image *mask, const char *mask_name, const uint32_t *image_header, unsigned int region_width)
+{
+    memset(mask, 0, sizeof(*mask));
+    if ((mask->file = fopen(mask_name, "rb")) == NULL) {
+        error("%s not found", mask_name);
+        return -1;
+    }
+    if (read_and_check_header(mask->header, mask->file, mask_name))
+        return -1;
+    if (mask->header[WIDTH_A] != image_header[WIDTH_A] ||
+        abs((signed)mask->header[HEIGHT_A]) != abs((signed)image_header[HEIGHT_A])) {
+        error("The linear dimensions of the mask and the images do not coincide");
+        return -1;
+    }
+    if ((mask->header[FORMAT_A] >> 16) == 8 &&
+        read_palette(mask->palette, mask->header[NUMBER_OF_COLORS_IN_PALETTE_A], mask->file))
+        return -1;
+    if (abs((signed)mask->header[HEIGHT_A]) != 0)
+        mask->bytes_in_row = (mask->header[FILE_SIZE_A] - mask->header[PIXEL_ARRAY_ADDRESS_A]) /
+                             abs((signed)mask->header[HEIGHT_A]);
+    if ((mask->row = malloc((size_t)region_width * 3 + 1)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void close_mask (mask_image *mask)
+{
+    if (mask->file != NULL)
+        fclose(mask->file);
+    free(mask->row);
+}
+
+
+//Sets the bytes_per_pixel bytes of every pixel of row y inside region to 0xff when the mask selects the pixel
+//and to 0 otherwise. Returns the number of selected pixels or -1.
+static long long read_mask_row (mask_image *mask, const bmp_region *region, unsigned int y,
+                                unsigned int bytes_per_pixel, uint8_t *selection)
+{
+    unsigned int rows = abs((signed)mask->header[HEIGHT_A]), depth = mask->header[FORMAT_A] >> 16,
+        row = (signed)mask->header[HEIGHT_A] < 0 ? y : rows - 1 - y;
+    long long selected = 0;
+    uint8_t *pixel = mask->row, chosen;
+    if (pread_row(fileno(mask->file), mask->row, (size_t)region->width * (depth / 8),
+                  mask->header[PIXEL_ARRAY_ADDRESS_A] + (long long)row * mask->bytes_in_row +
+                  (long long)region->x * (depth / 8)))
+        return -1;
+    for (unsigned int x = 0; x < region->width; x++, pixel += depth / 8) {
+        if (depth == 8)
+            chosen = mask->palette[pixel[0]] != 0 ? 0xff : 0;
+        else
+            chosen = (pixel[0] | pixel[1] | pixel[2]) != 0 ? 0xff : 0;
+        selected += chosen & 1;
+        for (unsigned int k = 0; k < bytes_per_pixel; k++)
+            selection[x * bytes_per_pixel + k] = chosen;
+    }
+    return selected;
+}
+
+
+//--region and --mask: only the part of the rows inside the region is read, one row at a time with pread.
+//Rows the mask does not select at all are not read.
+static int compare_selected_rows (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header,
+                                  FILE *second_input_file, const bmp_region *region, mask_image *mask,
+                                  row_kernel kernel, compare_job *job)
+{
+    unsigned int rows = abs((signed)first_header[HEIGHT_A]), bytes_per_pixel = (first_header[FORMAT_A] >> 16) / 8,
+        first_row, second_row;
+    size_t bytes_in_row = (first_header[FILE_SIZE_A] - first_header[PIXEL_ARRAY_ADDRESS_A]) / rows,
+        bytes_in_segment = (size_t)region->width * bytes_per_pixel;
+    uint8_t *first_segment, *second_segment, *selection;
+    long long selected = region->width;
+    perf_scope scope;
+    int result = 0;
+    if ((first_segment = malloc(3 * bytes_in_segment)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    second_segment = first_segment + bytes_in_segment;
+    selection = second_segment + bytes_in_segment;
+    job->x_offset = region->x;
+    for (unsigned int y = region->y; y < region->y + region->height && result == 0; y++) {
+        if (mask != NULL) {
+            if ((selected = read_mask_row(mask, region, y, bytes_per_pixel, selection)) < 0) {
+                result = -1;
+                break;
+            }
+            if (selected == 0)
+                continue;
+            job->mask = selection;
+        }
+        job->pixels += selected;
+        first_row = (signed)first_header[HEIGHT_A] < 0 ? y : rows - 1 - y;
+        second_row = (signed)second_header[HEIGHT_A] < 0 ? y : rows - 1 - y;
+        perf_phase_begin(&scope);
+        if (pread_row(fileno(first_input_file), first_segment, bytes_in_segment, first_header[PIXEL_ARRAY_ADDRESS_A] +
+                      (long long)first_row * bytes_in_row + (long long)region->x * bytes_per_pixel) ||
+            pread_row(fileno(second_input_file), second_segment, bytes_in_segment, second_header[PIXEL_ARRAY_ADDRESS_A] +
+                      (long long)second_row * bytes_in_row + (long long)region->x * bytes_per_pixel)) {
+            result = -1;
+            break;
+        }
+        perf_phase_end(&scope, PERF_PIXEL_READ, 2 * bytes_in_segment);
+        perf_phase_begin(&scope);
+        result = kernel(first_segment, second_segment, 0, 1, first_row, region->width, rows, job);
+        perf_phase_end(&scope, PERF_TRANSFORM, 2 * bytes_in_segment);
+    }
+    free(first_segment);
+    return result;
+}
+
+
+//Compares and reports, or only stores the number of mismatches in mismatches when it is not NULL
+static int compare_images (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header, FILE *second_input_file,
+                           const compare_options *options, long long *mismatches)
+{
+    unsigned int width = first_header[WIDTH_A], rows = abs((signed)first_header[HEIGHT_A]),
+        depth = first_header[FORMAT_A] >> 16;
+    int top_down = (signed)first_header[HEIGHT_A] < 0, result = 0;
+    const row_kernel (*kernels)[2];
+    bmp_region region = { 0, 0, width, rows };
+    mask_image mask;
+    compare_job job;
+    perf_scope scope;
+    if (width != second_header[WIDTH_A] || rows != (unsigned int)abs((signed)second_header[HEIGHT_A])){
+        error("The linear dimensions of the images do not coincide");
+        return -1;
+    }
+    if (depth != second_header[FORMAT_A] >> 16) {
+        error("Files have different bits. 8bit and 24bit");
+        return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.key = options->expect_negative ? 0xffffff : 0;
+    job.tolerance = options->tolerance;
+    job.measure = options->tolerance != 0 || options->metrics;
+    job.stop_at_first = options->quick;
+    job.max_reported = options->quick && options->max_diffs > 1 ? 1 : options->max_diffs;
+    if (options->use_region)
+        region = options->region;
+    if (!clip_region(&region, first_header)) {
+        if (mismatches == NULL)
+            return write_report(&job, options);
+        *mismatches = 0;
+        return 0;
+    }
+    if (depth == 8) {
+        job.first_colors = first_header[NUMBER_OF_COLORS_IN_PALETTE_A];
+        job.second_colors = second_header[NUMBER_OF_COLORS_IN_PALETTE_A];
+        perf_phase_begin(&scope);
+        if (read_palette(job.first_palette, job.first_colors, first_input_file) ||
+            read_palette(job.second_palette, job.second_colors, second_input_file))
+            return -1;
+        perf_phase_end(&scope, PERF_PALETTE, (job.first_colors + job.second_colors) * 4);
+        kernels = compare_8bit_kernels;
+    }
+    else
+        kernels = compare_24bit_kernels;
+    if (options->use_region || options->mask_name != NULL) {
+        if (options->mask_name != NULL && open_mask(&mask, options->mask_name, first_header, region.width)) {
+            close_mask(&mask);
+            return -1;
+        }
+        result = compare_selected_rows(first_header, first_input_file, second_header, second_input_file, &region,
+                                       options->mask_name != NULL ? &mask : NULL,
+                                       kernels[region.width % 4][top_down], &job);
+        if (options->mask_name != NULL)
+            close_mask(&mask);
+    }
+    else
+        result = compare_all_rows(first_header, first_input_file, second_header, second_input_file,
+                                  kernels[width % 4][top_down], &job, options->quick);
+    if (result >= 0 && mismatches != NULL)
+        *mismatches = job.mismatches;
+    else if (result >= 0 && write_report(&job, options))
+        result = -1;
+    free(job.coordinates);
+    if (result == 0 && job.mismatches != 0)
+        return 1;
+    return result;
+}
+
+
+int compare_pixel_arrays (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header, FILE *second_input_file,
+                          const compare_options *options)
+{
+    return compare_images(first_header, first_input_file, second_header, second_input_file, options, NULL);
+}
+
+
+long long count_differing_pixels (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header,
+                                  FILE *second_input_file, unsigned int tolerance)
+{
+    compare_options options;
+    long long mismatches = 0;
+    memset(&options, 0, sizeof(options));
+    options.tolerance = tolerance;
+    if (compare_images(first_header, first_input_file, second_header, second_input_file, &options, &mismatches) < 0)
+        return -1;
+    return mismatches;
+}
+
+
+//The kernels reject an 8-bit image with an index past the end of its palette, and the shortcuts below must too.
+//file is the whole image. Returns 0, or -1 after printing the error of the kernels.
+static int check_indexes (const uint8_t *file, const uint32_t *header)
+{
+    unsigned int width = header[WIDTH_A], rows = abs((signed)header[HEIGHT_A]);
+    unsigned int colors = header[NUMBER_OF_COLORS_IN_PALETTE_A];
+    size_t bytes_in_row = width + (4 - width % 4) % 4;
+    const uint8_t *row = file + header[PIXEL_ARRAY_ADDRESS_A];
+    uint8_t highest = 0;
+    if ((header[FORMAT_A] >> 16) != 8 || colors >= 256 || (unsigned long long)width * rows == 0)
+        return 0;
+    for (unsigned int y = 0; y < rows; y++, row += bytes_in_row)
+        for (unsigned int x = 0; x < width; x++)
+            highest = row[x] > highest ? row[x] : highest;
+    if (highest >= colors) {
+        error("Address value in a cell of a pixel array does not correspond to the number of colors in the palette (array overflow).");
+        return -1;
+    }
+    return 0;
+}
+
+
+//Both names lead to one file: the pixels equal themselves, but 8-bit ones are still checked against the palette
+static int check_same_file (uint32_t *header, FILE *input_file)
+{
+    size_t size = header[FILE_SIZE_A];
+    uint8_t *file;
+    int result;
+    if ((header[FORMAT_A] >> 16) != 8 || header[NUMBER_OF_COLORS_IN_PALETTE_A] >= 256)
+        return 0;
+    file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(input_file), 0);
+    if (file == MAP_FAILED) {
+        error("mmap() error.");
+        return -1;
+    }
+    result = check_indexes(file, header);
+    munmap(file, size);
+    return result;
+}
+
+
+//Byte-equal inputs are common (copies in a content-addressed cache), so images with the same layout are first
+//compared as whole mapped buffers with memcmp, which works on vector registers, before any per-pixel logic.
+//Returns 1 when everything after the header (palette and pixels) is equal, 0 when it is not or can not be mapped,
+//and -1 when the equal 8-bit images hold indexes past the end of their palette.
+static int same_image_bytes (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header, FILE *second_input_file)
+{
+    static const int layout[] = { FILE_SIZE_A, PIXEL_ARRAY_ADDRESS_A, WIDTH_A, HEIGHT_A, FORMAT_A, NUMBER_OF_COLORS_IN_PALETTE_A };
+    size_t size = first_header[FILE_SIZE_A];
+    uint8_t *first, *second;
+    int equal;
+    for (size_t i = 0; i < sizeof(layout) / sizeof(layout[0]); i++)
+        if (first_header[layout[i]] != second_header[layout[i]])
+            return 0;
+    if (size <= HEADER_SIZE)
+        return size == HEADER_SIZE;
+    first = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(first_input_file), 0);
+    if (first == MAP_FAILED)
+        return 0;
+    second = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(second_input_file), 0);
+    if (second == MAP_FAILED) {
+        munmap(first, size);
+        return 0;
+    }
+    madvise(first, size, MADV_SEQUENTIAL);
+    madvise(second, size, MADV_SEQUENTIAL);
+    equal = memcmp(first + HEADER_SIZE, second + HEADER_SIZE, size - HEADER_SIZE) == 0;
+    if (equal && check_indexes(first, first_header))
+        equal = -1;
+    munmap(first, size);
+    munmap(second, size);
+    return equal;
+}
+
+
+//The report of images found equal without a pixel scan
+static int report_no_mismatches (const compare_options *options)
+{
+    compare_job job;
+    if (options->format == COMPARE_REPORT_TEXT)
+        return 0;
+    memset(&job, 0, sizeof(job));
+    return write_report(&job, options);
+}
+
+
+void print_compare_usage (void)
+{
+    error("You must enter the names of the two spanning files:\n1.<input_file>.bmp\n2.<input_file>.bmp\n"
+          "Options before the names:\n--expect-negative - check that the second image is the exact negative of the first\n"
+          "--tolerance <0..255> - pixels match when no channel differs by more than the value\n"
+          "--metrics - print MSE, PSNR, the largest difference and the number of differing pixels per channel\n"
+          "--region <x,y,width,height> - compare only that rectangle (y from the top)\n"
+          "--mask <mask>.bmp - compare only the pixels that are not black in the mask, an image of the same size\n"
+          "--quick - stop at the first difference, checking a sample of rows before the full scan\n"
+          "--max-diffs <n> - report the coordinates of at most n mismatches (100 by default), the rest are only counted\n"
+          "--format <text|json|binary> - text on stderr (the default), or a JSON object or a binary record on stdout\n"
+          "--perf-counters - report cycles, IPC and cache, TLB and branch misses per MB for every phase\n"
+          "Or index images: --index-build <directory> <index> signs every .bmp file under the directory,\n"
+          "--index-query [--max-distance <0..64>] [--max-differing <0..100>] [--tolerance <0..255>] <index> <file>.bmp\n"
+          "prints the exact matches and the near ones of the same size: perceptual hashes at most 10 bits apart\n"
+          "(by default) and at most 5%% of the pixels differing (by default) in a full compare, each with\n"
+          "the hash distance and the number of differing pixels\n");
+}
+
+
+int parse_compare_arguments (int argc, char **argv, compare_options *options)
+{
+    long value;
+    char *end;
+    memset(options, 0, sizeof(*options));
+    options->max_diffs = REPORTED_MISMATCHES;
+    options->max_distance = NEAR_DISTANCE;
+    options->max_differing = NEAR_DIFFERING;
+    if (argc < 2) {
+        print_compare_usage();
+        return -1;
+    }
+    for (int i = 0; i < argc - 2; i++) {
+        if (!strcmp(argv[i], "--expect-negative"))
+            options->expect_negative = 1;
+        else if (!strcmp(argv[i], "--index-build"))
+            options->mode = COMPARE_INDEX_BUILD;
+        else if (!strcmp(argv[i], "--index-query"))
+            options->mode = COMPARE_INDEX_QUERY;
+        else if (!strcmp(argv[i], "--max-distance") && i + 1 < argc - 2) {
+            value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || value < 0 || value > 64) {
+                error("--max-distance expects a number from 0 to 64\n");
+                return -1;
+            }
+            options->max_distance = (unsigned int)value;
+        }
+        else if (!strcmp(argv[i], "--max-differing") && i + 1 < argc - 2) {
+            value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || value < 0 || value > 100) {
+                error("--max-differing expects a percentage from 0 to 100\n");
+                return -1;
+            }
+            options->max_differing = (unsigned int)value;
+        }
+        else if (!strcmp(argv[i], "--perf-counters"))
+            options->perf_counters = 1;
+        else if (!strcmp(argv[i], "--metrics"))
+            options->metrics = 1;
+        else if (!strcmp(argv[i], "--quick"))
+            options->quick = 1;
+        else if (!strcmp(argv[i], "--region") && i + 1 < argc - 2) {
+            if (parse_region(argv[++i], &options->region))
+                return -1;
+            options->use_region = 1;
+        }
+        else if (!strcmp(argv[i], "--mask") && i + 1 < argc - 2)
+            options->mask_name = argv[++i];
+        else if (!strcmp(argv[i], "--max-diffs") && i + 1 < argc - 2) {
+            options->max_diffs = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || options->max_diffs < 0 || options->max_diffs > INT32_MAX) {
+                error("--max-diffs expects a number from 0 to %d\n", INT32_MAX);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc - 2) {
+            i++;
+            if (!strcmp(argv[i], "text"))
+                options->format = COMPARE_REPORT_TEXT;
+            else if (!strcmp(argv[i], "json"))
+                options->format = COMPARE_REPORT_JSON;
+            else if (!strcmp(argv[i], "binary"))
+                options->format = COMPARE_REPORT_BINARY;
+            else {
+                error("--format expects text, json or binary\n");
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc - 2) {
+            value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || value < 0 || value > 255) {
+                error("--tolerance expects a number from 0 to 255\n");
+                return -1;
+            }
+            options->tolerance = (unsigned int)value;
+        }
+        else {
+            error("Unknown option: %s\n", argv[i]);
+            print_compare_usage();
+            return -1;
+        }
+    }
+    if (options->metrics && options->format == COMPARE_REPORT_BINARY) {
+        error("--metrics can not be written in the binary format\n");
+        return -1;
+    }
+    if (options->mode != COMPARE_PAIR && (options->expect_negative || options->metrics || options->use_region ||
+                                          options->mask_name != NULL || options->quick ||
+                                          options->format != COMPARE_REPORT_TEXT)) {
+        error("--index-build and --index-query accept only --tolerance, --max-distance,\n"
+              "--max-differing and --perf-counters\n");
+        return -1;
+    }
+    if (options->quick && options->metrics) {
+        error("--metrics needs the whole image and can not be used with --quick\n");
+        return -1;
+    }
+    options->first_name = argv[argc - 2];
+    options->second_name = argv[argc - 1];
+    return 0;
+}
+
+
+int compare_files (const compare_options *options)
+{
+    uint32_t first_header[HEADER_CELLS], second_header[HEADER_CELLS];
+    FILE *first_input_file, *second_input_file;
+    const char *first_name = options->first_name, *second_name = options->second_name;
+    struct stat first_status, second_status;
+    perf_scope scope;
+    //The whole-file shortcuts would read the rows a region or a mask leaves out
+    int result, equal, equality = !options->expect_negative && !options->metrics &&
+                                  !options->use_region && options->mask_name == NULL;
+    if (options->mode == COMPARE_INDEX_BUILD)
+        return build_image_index(first_name, second_name);
+    if (options->mode == COMPARE_INDEX_QUERY)
+        return query_image_index(first_name, second_name, options);
+    if ((first_input_file = fopen(first_name, "rb")) == NULL){
+        error("%s not found", first_name);
+        return -2;
+    }
+    if ((second_input_file = fopen(second_name, "rb")) == NULL){
+        error("%s not found", second_name);
+        fclose(first_input_file);
+        return -1;
+    }
+    //Both names lead to one file: only its header and its indexes are checked, so a broken file is still reported
+    if (equality && fstat(fileno(first_input_file), &first_status) == 0 &&
+        fstat(fileno(second_input_file), &second_status) == 0 &&
+        first_status.st_dev == second_status.st_dev && first_status.st_ino == second_status.st_ino) {
+        if ((result = read_and_check_header(first_header, first_input_file, first_name)) == 0 &&
+            check_same_file(first_header, first_input_file))
+            result = -1;
+        fclose(first_input_file);
+        fclose(second_input_file);
+        return result == 0 ? report_no_mismatches(options) : result;
+    }
+    perf_phase_begin(&scope);
+    if ((result = read_and_check_header(first_header, first_input_file, first_name)) == 0 &&
+        (result = read_and_check_header(second_header, second_input_file, second_name)) == 0) {
+        perf_phase_end(&scope, PERF_HEADER, 2 * HEADER_SIZE);
+        if (equality && (equal = same_image_bytes(first_header, first_input_file, second_header, second_input_file)) != 0)
+            result = equal > 0 ? report_no_mismatches(options) : -1;
+        else
+            result = compare_pixel_arrays(first_header, first_input_file, second_header, second_input_file, options);
+    }
+    fclose(first_input_file);
+    fclose(second_input_file);
+    return result;
+}
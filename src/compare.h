@@ -0,0 +1,60 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bmp_header.h"
+
+//Where and how the mismatches are reported
+typedef enum {
+    COMPARE_REPORT_TEXT,        //"(x , y)" lines and the total on stderr, the metrics table on stdout
+    COMPARE_REPORT_JSON,        //One JSON object on stdout
+    COMPARE_REPORT_BINARY       //"BMPD", version, total, count and the x, y pairs, little-endian, on stdout
+} compare_report_format;
+
+typedef enum {
+    COMPARE_PAIR,       //Compare <file1> with <file2>
+    COMPARE_INDEX_BUILD,        //--index-build <directory> <index>
+    COMPARE_INDEX_QUERY     //--index-query <index> <file>
+} compare_mode;
+
+typedef struct {
+    compare_mode mode;
+    int expect_negative;    //Check that the second image is the negative of the first instead of equality
+    unsigned int tolerance;     //Largest per-channel difference of pixels that still match
+    int metrics;    //Print MSE, PSNR, the largest difference and the number of differing pixels per channel
+    int use_region;     //Compare only region
+    bmp_region region;
+    const char *mask_name;      //Compare only the pixels that are not black in this image, or NULL
+    int quick;      //Only answer whether the images differ: check a row sample, then stop at the first difference
+    long long max_diffs;        //Coordinates of mismatches reported, the rest are only counted
+    compare_report_format format;
+    unsigned int max_distance;      //--index-query: bits the perceptual hashes of near matches may differ in
+    unsigned int max_differing;     //--index-query: percent of the pixels near matches may differ in
+    int perf_counters;      //Report hardware performance counters per phase (command line only)
+    const char *first_name;
+    const char *second_name;
+} compare_options;
+
+//Compares the pixel arrays of two images whose headers were checked, row band by row band. The rows are matched
+//by their position in the image, so images that store rows in different orders can be compared.
+//Mismatches are reported with y counted from the top row, in options->format, once the comparison is over.
+//Returns 0, 1 if the images differ or -1.
+int compare_pixel_arrays (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header, FILE *second_input_file,
+                          const compare_options *options);
+
+//Counts the pixels of two images whose headers were checked that differ by more than tolerance, reporting nothing.
+//Returns the count, or -1 after printing why the images can not be compared.
+long long count_differing_pixels (uint32_t *first_header, FILE *first_input_file, uint32_t *second_header,
+                                  FILE *second_input_file, unsigned int tolerance);
+
+void print_compare_usage (void);
+//Parses "[options] <file1> <file2>". Returns 0, or -1 after printing what is wrong.
+int parse_compare_arguments (int argc, char **argv, compare_options *options);
+
+//Compares two bmp files pixel by pixel and reports the mismatching pixels, or builds or queries an image index.
+//Returns 0 when the images match, 1 when they differ and a negative code when they can not be compared
+//(for a query: 0 when a match was found, 1 when none was).
+int compare_files (const compare_options *options);
+
+#endif
@@ -0,0 +1,917 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "bmp_header.h"
+#include "bmpneg.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "atomic_output.h"
+#include "convert.h"
+#include "geometry.h"
+#include "gray.h"
+#include "histogram.h"
+#include "qdbmp.h"
+#include "quantize.h"
+#include "rle.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define RLE_BAND_BYTES     (1 << 20)
+
+
+static int channels_swapped (const convert_options *options)
+{
+    return options->channel_order[0] != 0 || options->channel_order[1] != 1 || options->channel_order[2] != 2;
+}
+
+
+void apply_colors_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width, const convert_options *options)
+{
+    const uint8_t *order = options->channel_order;
+    const bmpneg_lut *lut = &options->lut;
+    size_t bytes_in_row = (size_t)width * 3 + width % 4;
+    uint8_t pixel[3];
+    if (!channels_swapped(options)) {
+        bmpneg_lut_apply_24bit_rows(rows, count, width, lut);
+        return;
+    }
+    for (unsigned int j = 0; j < count; j++, rows += bytes_in_row)
+        for (uint8_t *p = rows; p < rows + (size_t)width * 3; p += 3) {
+            memcpy(pixel, p, 3);
+            p[0] = lut->channel[0][pixel[order[0]]];
+            p[1] = lut->channel[1][pixel[order[1]]];
+            p[2] = lut->channel[2][pixel[order[2]]];
+        }
+}
+
+
+void apply_colors_palette (uint8_t *palette, unsigned int colors, const convert_options *options)
+{
+    const uint8_t *order = options->channel_order;
+    uint8_t entry[3];
+    if (!channels_swapped(options)) {
+        bmpneg_lut_apply_palette(palette, colors, &options->lut);
+        return;
+    }
+    for (uint8_t *p = palette; p < palette + colors * 4; p += 4) {
+        memcpy(entry, p, 3);
+        for (int c = 0; c < 3; c++)
+            p[c] = options->lut.channel[c][entry[order[c]]];
+    }
+}
+
+
+//Streams the pixel array of input_file into output_file through the band pipeline,
+//applying transform (or copying when it is NULL) while the next band is read and the previous one is written.
+int stream_pixel_array (FILE *input_file, FILE *output_file, uint32_t *header,
+                        band_transform_t transform, void *context, int direct_output)
+{
+    band_pipeline pipeline;
+    unsigned int bytes_in_pixel_arr = header[FILE_SIZE_A] - header[PIXEL_ARRAY_ADDRESS_A];
+    if (fflush(output_file)) {
+        error("Data writing error");
+        return -1;
+    }
+    pipeline.input_fd = fileno(input_file);
+    pipeline.output_fd = fileno(output_file);
+    pipeline.input_offset = header[PIXEL_ARRAY_ADDRESS_A];
+    pipeline.output_offset = header[PIXEL_ARRAY_ADDRESS_A];
+    pipeline.rows = abs((signed)header[HEIGHT_A]);
+    pipeline.row_size = pipeline.rows ? bytes_in_pixel_arr / pipeline.rows : 0;
+    pipeline.transform = transform;
+    pipeline.context = context;
+    pipeline.direct_output = direct_output;
+    return run_band_pipeline(&pipeline);
+}
+
+
+//Opens the preview of the conversion when one was asked for
+static int open_preview (convert_context *conversion, preview_writer *preview)
+{
+    const convert_options *options = conversion->options;
+    if (options->preview_name == NULL)
+        return 0;
+    if (preview_open(preview, options->preview_name, conversion->header, options->preview_scale))
+        return -1;
+    conversion->preview = preview;
+    return 0;
+}
+
+
+static int close_preview (convert_context *conversion, int result)
+{
+    if (conversion->preview == NULL)
+        return result;
+    if (result != 0) {
+        preview_abort(conversion->preview);
+        return result;
+    }
+    return preview_close(conversion->preview);
+}
+
+
+int write_rle_pixel_array (FILE *input_file, FILE *output_file, uint32_t *header, convert_context *conversion)
+{
+    unsigned int width = header[WIDTH_A], rows = header[HEIGHT_A], rows_per_band, count;
+    unsigned int bytes_in_row = width + (4 - width % 4) % 4;
+    int nibbles = conversion->options->compression == BMP_RLE4, result = 0;
+    long long input_offset = header[PIXEL_ARRAY_ADDRESS_A];
+    unsigned long long encoded_size = 0;
+    uint32_t encoded_header[HEADER_CELLS];
+    uint8_t *band, *encoded, *out;
+    perf_scope scope;
+    //Compressed bitmaps are always bottom-up, and RLE4 stores two indexes in one byte
+    if ((signed)header[HEIGHT_A] < 0) {
+        error("Top-down images can not be compressed. Convert them without --compress");
+        return -1;
+    }
+    if (nibbles && (header[NUMBER_OF_COLORS_IN_PALETTE_A] == 0 || header[NUMBER_OF_COLORS_IN_PALETTE_A] > 16)) {
+        error("--compress rle4 needs a palette of at most 16 colors");
+        return -1;
+    }
+    rows_per_band = bytes_in_row ? RLE_BAND_BYTES / bytes_in_row : 1;
+    if (rows_per_band == 0)
+        rows_per_band = 1;
+    if (rows_per_band > rows)
+        rows_per_band = rows;
+    band = malloc((size_t)rows_per_band * bytes_in_row + 1);
+    encoded = malloc(rows_per_band * RLE_ROW_BOUND(width));
+    if (band == NULL || encoded == NULL) {
+        error("Memory allocation error.");
+        free(band);
+        free(encoded);
+        return -1;
+    }
+    for (unsigned int y = 0; y < rows && result == 0; y += count) {
+        count = rows - y < rows_per_band ? rows - y : rows_per_band;
+        perf_phase_begin(&scope);
+        result = pread_full(fileno(input_file), band, (size_t)count * bytes_in_row, input_offset);
+        perf_phase_end(&scope, PERF_PIXEL_READ, (size_t)count * bytes_in_row);
+        if (result != 0) {
+            error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            result = -1;
+            break;
+        }
+        input_offset += (long long)count * bytes_in_row;
+        perf_phase_begin(&scope);
+        out = encoded;
+        for (unsigned int j = 0; j < count; j++) {
+            //A row with an index that does not fit a nibble is not encoded at all
+            for (unsigned int x = 0; nibbles && x < width; x++)
+                if (band[(size_t)j * bytes_in_row + x] >= 16) {
+                    error("--compress rle4 needs palette indexes below 16");
+                    free(band);
+                    free(encoded);
+                    return -1;
+                }
+            out += rle_encode_row(band + (size_t)j * bytes_in_row, width, nibbles, y + j + 1 == rows, out);
+        }
+        if (conversion->preview != NULL || conversion->index_counts != NULL)
+            inspect_8bit_band(band, count, conversion);
+        perf_phase_end(&scope, PERF_TRANSFORM, (size_t)count * bytes_in_row);
+        perf_phase_begin(&scope);
+        if (fwrite(encoded, sizeof(uint8_t), out - encoded, output_file) != (size_t)(out - encoded)) {
+            error("Data writing error");
+            result = -1;
+        }
+        perf_phase_end(&scope, PERF_WRITE, out - encoded);
+        encoded_size += out - encoded;
+    }
+    free(band);
+    free(encoded);
+    if (result != 0)
+        return result;
+    //The header was written with the uncompressed layout, now the encoded size is known
+    memcpy(encoded_header, header, sizeof(encoded_header));
+    encoded_header[FORMAT_A] = (nibbles ? 4 : 8) << 16 | 1;
+    encoded_header[COMPRESSION_A] = conversion->options->compression;
+    encoded_header[IMAGE_SIZE_A] = encoded_size;
+    encoded_header[FILE_SIZE_A] = header[PIXEL_ARRAY_ADDRESS_A] + encoded_size;
+    //The stream is left at the end of the image, where an output written in place is cut off
+    if (fseek(output_file, 2, SEEK_SET) ||
+        fwrite(encoded_header, sizeof(uint8_t), HEADER_SIZE - 2, output_file) != HEADER_SIZE - 2 ||
+        fseek(output_file, encoded_header[FILE_SIZE_A], SEEK_SET)) {
+        error("Data writing error");
+        return -1;
+    }
+    return 0;
+}
+
+
+void indexed_header (const uint32_t *header, unsigned int colors, uint32_t *result_header)
+{
+    unsigned int width = header[WIDTH_A], height = abs((signed)header[HEIGHT_A]);
+    size_t result_row = width + (4 - width % 4) % 4;
+    memcpy(result_header, header, sizeof(uint32_t) * HEADER_CELLS);
+    result_header[PIXEL_ARRAY_ADDRESS_A] = HEADER_SIZE + colors * 4;
+    result_header[FORMAT_A] = (header[FORMAT_A] & 0xffff) | 8 << 16;
+    result_header[COMPRESSION_A] = 0;
+    result_header[IMAGE_SIZE_A] = result_row * height;
+    result_header[FILE_SIZE_A] = HEADER_SIZE + colors * 4 + result_row * height;
+    result_header[NUMBER_OF_COLORS_IN_PALETTE_A] = colors;
+    result_header[HEADER_CELLS - 1] = 0;        //Important colors: all of them
+}
+
+
+int write_8bit_head (FILE *output_file, const uint32_t *header, const uint8_t *palette)
+{
+    uint16_t header_field = 0x4d42;
+    unsigned int bytes_in_palette_arr = header[NUMBER_OF_COLORS_IN_PALETTE_A] * 4;
+    if (fwrite(&header_field, sizeof(uint16_t), 1, output_file) != 1 ||
+        fwrite(header, sizeof(uint8_t), HEADER_SIZE - 2, output_file) != HEADER_SIZE - 2 ||
+        fwrite(palette, sizeof(uint8_t), bytes_in_palette_arr, output_file) != bytes_in_palette_arr ||
+        fflush(output_file)) {
+        error("Data writing error");
+        return -1;
+    }
+    return 0;
+}
+
+
+int convert_8bit_to_negative (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options,
+                              image_histogram *histogram) {
+    uint8_t *palette, source_palette[256 * 4];
+    uint64_t index_counts[256] = { 0 };
+    unsigned int bytes_in_palette_arr = header[NUMBER_OF_COLORS_IN_PALETTE_A] * 4;
+    convert_context conversion = { header, options, NULL, NULL, NULL, histogram != NULL ? index_counts : NULL };
+    preview_writer preview;
+    perf_scope scope;
+    int result;
+    perf_phase_begin(&scope);
+    //All 256 entries are allocated, so indexes outside a short palette read black in the preview
+    if ((palette = calloc(256 * 4, sizeof(uint8_t))) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    if (fread(palette, sizeof(uint8_t), bytes_in_palette_arr, input_file) != bytes_in_palette_arr ) {
+        free(palette);
+        if (feof(input_file))
+            error("Palette read error. End of file.");
+        else
+            error("Palette read error.");
+        return -1;
+    }
+    //The histogram of the source resolves the index counts through the palette as it was read
+    memcpy(source_palette, palette, sizeof(source_palette));
+    apply_colors_palette(palette, header[NUMBER_OF_COLORS_IN_PALETTE_A], options);
+    perf_phase_end(&scope, PERF_PALETTE, bytes_in_palette_arr);
+    perf_phase_begin(&scope);
+    if (write_8bit_head(output_file, header, palette)) {
+        free(palette);
+        return -1;
+    }
+    perf_phase_end(&scope, PERF_WRITE, HEADER_SIZE + bytes_in_palette_arr);
+    conversion.palette = palette;
+    if (open_preview(&conversion, &preview)) {
+        free(palette);
+        return -1;
+    }
+    //The pixels of an 8-bit image are palette indexes, so they are copied unchanged
+    if (options->compression)
+        result = write_rle_pixel_array(input_file, output_file, header, &conversion);
+    else
+        result = stream_pixel_array(input_file, output_file, header,
+                                    conversion.preview != NULL || histogram != NULL ? inspect_8bit_band : NULL,
+                                    &conversion, options->direct_output);
+    free(palette);
+    if (histogram != NULL) {
+        memset(histogram, 0, sizeof(*histogram));
+        histogram_add_palette(histogram, index_counts, source_palette);
+    }
+    return close_preview(&conversion, result);
+}
+
+
+void transform_24bit_band (uint8_t *band, unsigned int rows, void *context)
+{
+    convert_context *conversion = context;
+    unsigned int width = conversion->header[WIDTH_A];
+    //The source colors are counted while the band is in cache, before the operations change them
+    if (conversion->histogram != NULL)
+        histogram_add_24bit_rows(conversion->histogram, band, rows, width);
+    apply_colors_24bit_rows(band, rows, width, conversion->options);
+    //The band is still in cache, so the preview adds no I/O and little memory traffic
+    if (conversion->preview != NULL)
+        preview_add_24bit_rows(conversion->preview, band, rows, (size_t)width * 3 + width % 4);
+}
+
+
+void inspect_8bit_band (uint8_t *band, unsigned int rows, void *context)
+{
+    convert_context *conversion = context;
+    unsigned int width = conversion->header[WIDTH_A];
+    if (conversion->index_counts != NULL)
+        histogram_add_indexes(conversion->index_counts, band, rows, width);
+    if (conversion->preview != NULL)
+        preview_add_8bit_rows(conversion->preview, band, rows, width + (4 - width % 4) % 4, conversion->palette);
+}
+
+
+int convert_24bit_to_negative(FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options,
+                              image_histogram *histogram)
+{
+    uint16_t header_field = 0x4d42;
+    convert_context conversion = { header, options, NULL, NULL, histogram, NULL };
+    preview_writer preview;
+    perf_scope scope;
+    perf_phase_begin(&scope);
+    if (fwrite(&header_field, sizeof(uint16_t), 1, output_file) != 1) {
+        error("Data writing error");
+        return -1;
+    }
+    if (fwrite(header, sizeof(uint8_t), HEADER_SIZE - 2, output_file) != HEADER_SIZE - 2) {
+        error("Data writing error");
+        return -1;
+    }
+    perf_phase_end(&scope, PERF_WRITE, HEADER_SIZE);
+    if (histogram != NULL)
+        memset(histogram, 0, sizeof(*histogram));
+    if (open_preview(&conversion, &preview))
+        return -1;
+    return close_preview(&conversion, stream_pixel_array(input_file, output_file, header, transform_24bit_band,
+                                                         &conversion, options->direct_output));
+}
+
+
+//Copies size bytes from the start of input_fd to output_fd. copy_file_range lets the kernel
+//(or the file system, by sharing extents) do the copy, plain reads and writes are the fallback.
+static int copy_whole_file (int input_fd, int output_fd, long long size)
+{
+    long long offset = 0;
+    uint8_t *buffer;
+    size_t chunk;
+    int result = 0;
+#ifdef __NR_copy_file_range
+    loff_t input_offset = 0, output_offset = 0;
+    long done;
+    while (offset < size) {
+        done = syscall(__NR_copy_file_range, input_fd, &input_offset, output_fd, &output_offset, size - offset, 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            break;
+        offset += done;
+    }
+#endif
+    if (offset == size)
+        return 0;
+    if ((buffer = malloc(1 << 20)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    for (; offset < size && result == 0; offset += chunk) {
+        chunk = size - offset < (1 << 20) ? size - offset : (1 << 20);
+        if ((result = pread_full(input_fd, buffer, chunk, offset)) != 0)
+            error("File read error.");
+        else if ((result = pwrite_full(output_fd, buffer, chunk, offset)) != 0)
+            error("Data writing error");
+    }
+    free(buffer);
+    return result ? -1 : 0;
+}
+
+
+int convert_region (FILE *input_file, uint32_t *header, FILE *output_file, int in_place, const convert_options *options)
+{
+    bmp_region region = options->region;
+    unsigned int rows = abs((signed)header[HEIGHT_A]), row;
+    size_t bytes_in_row, bytes_in_segment;
+    long long offset;
+    uint8_t *segment;
+    perf_scope scope;
+    int input_fd = fileno(input_file), output_fd = fileno(output_file), result = 0;
+    if ((header[FORMAT_A] >> 16) != 24) {
+        error("--region supports only 24-bit images: the colors of 8-bit ones are shared through the palette");
+        return -1;
+    }
+    if (!in_place && copy_whole_file(input_fd, output_fd, header[FILE_SIZE_A]))
+        return -1;
+    if (!clip_region(&region, header))
+        return 0;
+    bytes_in_row = (header[FILE_SIZE_A] - header[PIXEL_ARRAY_ADDRESS_A]) / rows;
+    bytes_in_segment = (size_t)region.width * 3;
+    if ((segment = malloc(bytes_in_segment)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    //Only the part of every row inside the region is read and written back
+    for (unsigned int y = region.y; y < region.y + region.height && result == 0; y++) {
+        row = (signed)header[HEIGHT_A] < 0 ? y : rows - 1 - y;
+        offset = header[PIXEL_ARRAY_ADDRESS_A] + (long long)row * bytes_in_row + (long long)region.x * 3;
+        perf_phase_begin(&scope);
+        if ((result = pread_full(input_fd, segment, bytes_in_segment, offset)) != 0) {
+            error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            result = -1;
+            break;
+        }
+        perf_phase_end(&scope, PERF_PIXEL_READ, bytes_in_segment);
+        perf_phase_begin(&scope);
+        apply_colors_24bit_rows(segment, 1, region.width, options);
+        perf_phase_end(&scope, PERF_TRANSFORM, bytes_in_segment);
+        perf_phase_begin(&scope);
+        if ((result = pwrite_full(output_fd, segment, bytes_in_segment, offset)) != 0)
+            error("Data writing error");
+        perf_phase_end(&scope, PERF_WRITE, bytes_in_segment);
+    }
+    free(segment);
+    return result;
+}
+
+
+int convert_to_negative_qdbmp (const char *input_name, FILE *output_file)
+{
+    UCHAR	r, g, b;
+    UINT	width, height;
+    UINT	x, y, i;
+    BMP*	bmp;
+    BMP_STATUS	status = BMP_OK;
+    /* Read an image file. The reentrant calls keep the status local, so conversions may run in parallel */
+    if ( ( status = BMP_ReadFile_r( input_name, &bmp ) ) != BMP_OK )
+    {
+        fprintf( stderr, "BMP error: %s\n", BMP_GetStatusDescription( status ) );
+        return -1;
+    }
+    /* Get image's dimensions */
+    width = BMP_GetWidth( bmp );
+    height = BMP_GetHeight( bmp );
+    /* The pixels of an 8-bit image are palette indexes, so its palette is inverted instead */
+    if ( BMP_GetDepth( bmp ) == 8 )
+    {
+        for ( i = 0 ; i < 256 && status == BMP_OK ; ++i )
+        {
+            if ( ( status = BMP_GetPaletteColor_r( bmp, (UCHAR)i, &r, &g, &b ) ) == BMP_OK )
+                status = BMP_SetPaletteColor_r( bmp, (UCHAR)i, ~r, ~g, ~b );
+        }
+    }
+    /* Iterate through all the image's pixels */
+    for ( x = 0 ; x < width && status == BMP_OK && BMP_GetDepth( bmp ) != 8 ; ++x )
+    {
+        for ( y = 0 ; y < height && status == BMP_OK ; ++y )
+        {
+            /* Get pixel's RGB values */
+            if ( ( status = BMP_GetPixelRGB_r( bmp, x, y, &r, &g, &b ) ) == BMP_OK )
+                /* Invert RGB values */
+                status = BMP_SetPixelRGB_r( bmp, x, y, ~r, ~g, ~b );
+        }
+    }
+    /* Save result */
+    if ( status == BMP_OK )
+        status = BMP_WriteStream_r( bmp, output_file );
+    /* Free all memory allocated for the image */
+    BMP_Free( bmp );
+    if ( status != BMP_OK )
+    {
+        fprintf( stderr, "BMP error: %s\n", BMP_GetStatusDescription( status ) );
+        return -1;
+    }
+    return 0;
+}
+
+
+void print_convert_usage (void)
+{
+    error("You must enter 3 arguments with a space:\n1.'--mine' or '--theirs' (this argument should be the first)\n2.<input_file>.bmp\n3.<output_file>.bmp\n"
+          "--mine may be followed by tone operations, applied in the given order instead of the negative:\n"
+          "--negative, --invert-channels <r|g|b letters>, --brightness <-255..255>, --gamma <value>, --threshold <0..255>, --posterize <2..256>\n"
+          "--op <negate|flipv|fliph|rotate90|rotate180|rotate270|transpose|crop=x,y,width,height|swap=<two of r, g, b>>\n"
+          "may be repeated, the operations are applied in the given order in one pass over the image (rotations are clockwise)\n"
+          "--region <x,y,width,height> after the mode converts only that rectangle of a 24-bit image (y from the top),\n"
+          "the rest is copied; the input and the output may be the same file\n"
+          "--preview <file> [--scale 1/<n>] after the mode also writes a 24-bit copy of the result downscaled n times\n"
+          "(8 by default) with a box filter, from the same pass over the input\n"
+          "--compress <rle8|rle4> after the mode run-length encodes the pixels of an 8-bit image (rle4 needs at most 16 colors)\n"
+          "--gray after the mode writes a 24-bit image as 8-bit gray (luma), the tone operations are applied to the gray\n"
+          "--quantize <2..256> after the mode writes a 24-bit image as 8-bit with a median cut palette of that many colors,\n"
+          "the tone operations are applied to the palette\n"
+          "--histogram after the mode prints the min, max, mean and 256 counts of every channel of the input and of the result\n"
+          "on stdout, counted from the rows the conversion reads anyway\n"
+          "--auto-levels stretches every channel of the source so that all but its 0.5%% darkest and brightest pixels span\n"
+          "0..255, before the other operations (the input is read once more for its histogram)\n"
+          "--direct after the mode writes the pixels with O_DIRECT, bypassing the page cache (for huge one-shot outputs)\n"
+          "--perf-counters after the mode reports cycles, IPC and cache, TLB and branch misses per MB for every phase\n"
+          "Or run a conversion service: --serve <socket> and send it requests: --client <socket> convert|compare <arguments>");
+}
+
+
+static int parse_number (const char *text, long minimum, long maximum, long *value)
+{
+    char *end;
+    *value = strtol(text, &end, 10);
+    return *end != '\0' || end == text || *value < minimum || *value > maximum;
+}
+
+
+static int channel_index (char letter)
+{
+    return letter == 'b' ? 0 : letter == 'g' ? 1 : letter == 'r' ? 2 : -1;
+}
+
+
+//Swaps channels a and b of the result. The swap comes after the operations given so far,
+//so their tables move with the channels they were meant for.
+static void swap_channels (convert_options *options, int a, int b)
+{
+    uint8_t table[256], index = options->channel_order[a];
+    options->channel_order[a] = options->channel_order[b];
+    options->channel_order[b] = index;
+    memcpy(table, options->lut.channel[a], sizeof(table));
+    memcpy(options->lut.channel[a], options->lut.channel[b], sizeof(table));
+    memcpy(options->lut.channel[b], table, sizeof(table));
+}
+
+
+static int add_geometry (convert_options *options, geometry_kind kind)
+{
+    if (options->geometry_count == MAX_GEOMETRY_OPS) {
+        error("Too many flips, rotations and crops\n");
+        return -1;
+    }
+    options->geometry[options->geometry_count++].kind = kind;
+    return 0;
+}
+
+
+//One step of --op: negate, flipv, fliph, rotate90, rotate180, rotate270 (clockwise), transpose,
+//crop=<x,y,width,height> or swap=<two of r, g, b>
+static int parse_operation (const char *text, convert_options *options)
+{
+    int a, b;
+    if (!strcmp(text, "negate")) {
+        bmpneg_lut_negate(&options->lut);
+        return 0;
+    }
+    if (!strncmp(text, "swap=", 5)) {
+        if (strlen(text) != 7 || (a = channel_index(text[5])) < 0 || (b = channel_index(text[6])) < 0 || a == b) {
+            error("--op swap= expects two different letters of r, g and b\n");
+            return -1;
+        }
+        swap_channels(options, a, b);
+        return 0;
+    }
+    if (!strcmp(text, "flipv"))
+        return add_geometry(options, GEOMETRY_FLIP_VERTICAL);
+    if (!strcmp(text, "fliph"))
+        return add_geometry(options, GEOMETRY_FLIP_HORIZONTAL);
+    if (!strcmp(text, "transpose"))
+        return add_geometry(options, GEOMETRY_TRANSPOSE);
+    if (!strcmp(text, "rotate90"))
+        return add_geometry(options, GEOMETRY_TRANSPOSE) || add_geometry(options, GEOMETRY_FLIP_HORIZONTAL);
+    if (!strcmp(text, "rotate180"))
+        return add_geometry(options, GEOMETRY_FLIP_HORIZONTAL) || add_geometry(options, GEOMETRY_FLIP_VERTICAL);
+    if (!strcmp(text, "rotate270"))
+        return add_geometry(options, GEOMETRY_TRANSPOSE) || add_geometry(options, GEOMETRY_FLIP_VERTICAL);
+    if (!strncmp(text, "crop=", 5)) {
+        if (add_geometry(options, GEOMETRY_CROP))
+            return -1;
+        return parse_region(text + 5, &options->geometry[options->geometry_count - 1].crop);
+    }
+    error("Unknown operation: %s. Operations are negate, flipv, fliph, rotate90, rotate180, rotate270, transpose,\n"
+          "crop=<x,y,width,height> and swap=<channels>\n", text);
+    return -1;
+}
+
+
+int parse_convert_arguments (int argc, char **argv, convert_options *options)
+{
+    long value;
+    double gamma;
+    char *end;
+    int channels, operations = 0;
+    memset(options, 0, sizeof(*options));
+    bmpneg_lut_identity(&options->lut);
+    for (int c = 0; c < 3; c++)
+        options->channel_order[c] = c;
+    if (argc < 3 || (strcmp(argv[0], "--mine") && strcmp(argv[0], "--theirs"))) {
+        print_convert_usage();
+        return -1;
+    }
+    options->theirs = !strcmp(argv[0], "--theirs");
+    for (int i = 1; i < argc - 2; i++, operations++) {
+        if (!strcmp(argv[i], "--perf-counters")) {
+            options->perf_counters = 1;
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--region") && i + 1 < argc - 2) {
+            if (parse_region(argv[++i], &options->region))
+                return -1;
+            options->use_region = 1;
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--preview") && i + 1 < argc - 2) {
+            options->preview_name = argv[++i];
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--compress") && i + 1 < argc - 2) {
+            i++;
+            if (!strcmp(argv[i], "rle8"))
+                options->compression = BMP_RLE8;
+            else if (!strcmp(argv[i], "rle4"))
+                options->compression = BMP_RLE4;
+            else {
+                error("--compress expects rle8 or rle4\n");
+                return -1;
+            }
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc - 2) {
+            if (strncmp(argv[++i], "1/", 2) || parse_number(argv[i] + 2, 1, 4096, &value)) {
+                error("--scale expects 1/<n> with n from 1 to 4096\n");
+                return -1;
+            }
+            options->preview_scale = (unsigned int)value;
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--direct")) {
+            options->direct_output = 1;
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--histogram")) {
+            options->histogram = 1;
+            operations--;
+        }
+        else if (!strcmp(argv[i], "--gray"))
+            options->gray = 1;
+        else if (!strcmp(argv[i], "--quantize") && i + 1 < argc - 2) {
+            if (parse_number(argv[++i], 2, 256, &value)) {
+                error("--quantize expects a number of colors from 2 to 256\n");
+                return -1;
+            }
+            options->palette_colors = (unsigned int)value;
+        }
+        else if (!strcmp(argv[i], "--op") && i + 1 < argc - 2) {
+            if (parse_operation(argv[++i], options))
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--negative"))
+            bmpneg_lut_negate(&options->lut);
+        else if (!strcmp(argv[i], "--auto-levels"))
+            options->auto_levels = 1;
+        else if (i + 1 == argc - 2) {
+            error("Unknown option or missing value: %s\n", argv[i]);
+            print_convert_usage();
+            return -1;
+        }
+        else if (!strcmp(argv[i], "--invert-channels")) {
+            channels = 0;
+            for (end = argv[++i]; *end != '\0'; end++) {
+                if (*end == 'r') channels |= BMPNEG_RED;
+                else if (*end == 'g') channels |= BMPNEG_GREEN;
+                else if (*end == 'b') channels |= BMPNEG_BLUE;
+                else break;
+            }
+            if (*end != '\0' || channels == 0) {
+                error("--invert-channels expects a combination of the letters r, g and b\n");
+                return -1;
+            }
+            bmpneg_lut_invert_channels(&options->lut, channels);
+        }
+        else if (!strcmp(argv[i], "--brightness")) {
+            if (parse_number(argv[++i], -255, 255, &value)) {
+                error("--brightness expects a number from -255 to 255\n");
+                return -1;
+            }
+            bmpneg_lut_brightness(&options->lut, (int)value);
+        }
+        else if (!strcmp(argv[i], "--gamma")) {
+            gamma = strtod(argv[++i], &end);
+            if (*end != '\0' || end == argv[i] || !(gamma > 0)) {
+                error("--gamma expects a positive number\n");
+                return -1;
+            }
+            bmpneg_lut_gamma(&options->lut, gamma);
+        }
+        else if (!strcmp(argv[i], "--threshold")) {
+            if (parse_number(argv[++i], 0, 255, &value)) {
+                error("--threshold expects a number from 0 to 255\n");
+                return -1;
+            }
+            bmpneg_lut_threshold(&options->lut, (uint8_t)value);
+        }
+        else if (!strcmp(argv[i], "--posterize")) {
+            if (parse_number(argv[++i], 2, 256, &value)) {
+                error("--posterize expects a number from 2 to 256\n");
+                return -1;
+            }
+            bmpneg_lut_posterize(&options->lut, (unsigned int)value);
+        }
+        else {
+            error("Unknown option: %s\n", argv[i]);
+            print_convert_usage();
+            return -1;
+        }
+    }
+    if (operations == 0)
+        bmpneg_lut_negate(&options->lut);
+    else if (options->theirs) {
+        error("Tone operations are supported only with --mine\n");
+        return -1;
+    }
+    if (options->use_region && options->theirs) {
+        error("--region is supported only with --mine\n");
+        return -1;
+    }
+    if (options->preview_name == NULL && options->preview_scale != 0) {
+        error("--scale is used only with --preview\n");
+        return -1;
+    }
+    if (options->preview_name != NULL && (options->theirs || options->use_region)) {
+        error("--preview is supported only with --mine and without --region\n");
+        return -1;
+    }
+    if (options->geometry_count &&
+        (options->use_region || options->preview_name != NULL || options->compression || options->direct_output)) {
+        error("--op flips, rotations and crops can not be combined with --region, --preview, --compress or --direct\n");
+        return -1;
+    }
+    if (options->direct_output && (options->theirs || options->use_region || options->compression)) {
+        error("--direct is supported only with --mine, without --region and --compress\n");
+        return -1;
+    }
+    if (options->compression && (options->theirs || options->use_region)) {
+        error("--compress is supported only with --mine and without --region\n");
+        return -1;
+    }
+    if ((options->gray || options->palette_colors) &&
+        (options->use_region || options->preview_name != NULL || options->compression || options->direct_output ||
+         options->geometry_count || (options->gray && options->palette_colors))) {
+        error("--gray and --quantize can not be combined with each other, --region, --preview, --compress, --direct\n"
+              "or --op flips, rotations and crops\n");
+        return -1;
+    }
+    if (options->histogram && (options->theirs || options->use_region || options->geometry_count || options->gray ||
+                               options->palette_colors)) {
+        error("--histogram is supported only with --mine, without --region, --gray, --quantize\n"
+              "and --op flips, rotations and crops\n");
+        return -1;
+    }
+    if (options->auto_levels && (options->use_region || options->gray)) {
+        error("--auto-levels can not be combined with --region or --gray\n");
+        return -1;
+    }
+    if (options->preview_scale == 0)
+        options->preview_scale = 8;
+    options->input_name = argv[argc - 2];
+    options->output_name = argv[argc - 1];
+    options->output_fd = -1;
+    return 0;
+}
+
+
+//--auto-levels: result channel c takes source channel channel_order[c], which is stretched before the lut
+static void apply_auto_levels (const image_histogram *histogram, convert_options *options)
+{
+    bmpneg_lut stretch, lut = options->lut;
+    histogram_levels(histogram, &stretch);
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            options->lut.channel[c][v] = lut.channel[c][stretch.channel[options->channel_order[c]][v]];
+}
+
+
+//The output of a service request may be a descriptor passed by the client, which is written in place
+static int open_output (atomic_output *output, const convert_options *options, unsigned long long size)
+{
+    if (options->output_fd >= 0)
+        return atomic_output_open_passed(output, options->output_fd, options->output_name, size);
+    return atomic_output_open(output, options->output_name, size, 0);
+}
+
+
+int convert_files (const convert_options *options)
+{
+    uint32_t header[HEADER_CELLS], result_header[HEADER_CELLS];
+    image_histogram source_histogram, result_histogram, *counted = NULL;
+    convert_options leveled;
+    FILE *input_file, *output_file;
+    geometry_view view;
+    atomic_output output;
+    const char *input_name = options->input_name, *output_name = options->output_name;
+    struct stat input_status, output_status;
+    perf_scope scope;
+    int result, in_place;
+    if ((input_file = fopen(input_name, "rb")) == NULL){
+        error("File not found");
+        return -1;
+    }
+    perf_phase_begin(&scope);
+    result = read_and_check_header(header, input_file, input_name);
+    perf_phase_end(&scope, PERF_HEADER, HEADER_SIZE);
+    if (result != 0) {
+        fclose(input_file);
+        return result;
+    }
+    if (options->theirs){
+        fclose(input_file);
+        if ((signed)header[HEIGHT_A] < 0){
+            error("qdbmp library not support negative height images. Use --mine option ");
+            return -2;
+        }
+        if (open_output(&output, options, 0))
+            return -1;
+        if(convert_to_negative_qdbmp(input_name, output.file)) {
+            atomic_output_abort(&output);
+            return -3;
+        }
+        return atomic_output_commit(&output);
+    }
+    if (options->compression && (header[FORMAT_A] >> 16) != 8) {
+        error("--compress supports only 8-bit images");
+        fclose(input_file);
+        return -1;
+    }
+    if ((options->gray || options->palette_colors) && (header[FORMAT_A] >> 16) != 24) {
+        error(options->gray ? "--gray supports only 24-bit images" : "--quantize supports only 24-bit images");
+        fclose(input_file);
+        return -1;
+    }
+    //The stretch needs the histogram before the first pixel is converted, so that one takes a pass of its own.
+    //Otherwise the histogram is counted by the conversion.
+    if (options->auto_levels) {
+        if (histogram_scan(fileno(input_file), header, &source_histogram)) {
+            fclose(input_file);
+            return -1;
+        }
+        leveled = *options;
+        apply_auto_levels(&source_histogram, &leveled);
+        options = &leveled;
+    }
+    else if (options->histogram)
+        counted = &source_histogram;
+    //A region may be converted in place, the output must not be truncated then
+    in_place = options->use_region &&
+               (options->output_fd >= 0 ? fstat(options->output_fd, &output_status) : stat(output_name, &output_status)) == 0 &&
+               fstat(fileno(input_file), &input_status) == 0 &&
+               input_status.st_dev == output_status.st_dev && input_status.st_ino == output_status.st_ino;
+    if (in_place) {
+        //A passed output keeps its size at the commit, only the region is rewritten
+        if (options->output_fd >= 0) {
+            if (open_output(&output, options, output_status.st_size)) {
+                fclose(input_file);
+                return -1;
+            }
+            output_file = output.file;
+        }
+        else if ((output_file = fopen(output_name, "r+b")) == NULL){
+            error("Can not create %s", output_name);
+            fclose(input_file);
+            return -1;
+        }
+        result = convert_region(input_file, header, output_file, in_place, options);
+        if (options->output_fd < 0)
+            fclose(output_file);
+        else if (result == 0)
+            result = atomic_output_commit(&output);
+        else
+            atomic_output_abort(&output);
+        fclose(input_file);
+        return result;
+    }
+    //Every other output is built aside and replaces the target only when complete.
+    //The size of an encoded pixel array is not known in advance, so it is not allocated.
+    if (options->geometry_count) {
+        if (resolve_geometry(header, options, &view)) {
+            fclose(input_file);
+            return -1;
+        }
+        geometry_header(header, &view, result_header);
+    }
+    else if (options->gray)
+        indexed_header(header, 256, result_header);
+    else if (options->palette_colors)
+        indexed_header(header, options->palette_colors, result_header);
+    else
+        memcpy(result_header, header, sizeof(result_header));
+    if (open_output(&output, options, options->compression ? 0 : result_header[FILE_SIZE_A])) {
+        fclose(input_file);
+        return -1;
+    }
+    output_file = output.file;
+    if (options->geometry_count)
+        result = convert_geometry(input_file, header, output_file, options);
+    else if (options->gray)
+        result = convert_24bit_to_gray(input_file, header, output_file, options);
+    else if (options->palette_colors)
+        result = convert_24bit_to_quantized(input_file, header, output_file, options);
+    else if (options->use_region)
+        result = convert_region(input_file, header, output_file, in_place, options);
+    else if ((header[FORMAT_A] >> 16) == 8)
+        result = convert_8bit_to_negative(input_file, header, output_file, options, counted);
+    else
+        result = convert_24bit_to_negative(input_file, header, output_file, options, counted);
+    if (result == 0)
+        result = atomic_output_commit(&output);
+    else
+        atomic_output_abort(&output);
+    fclose(input_file);
+    //The result histogram follows from the source one through the color operations
+    if (result == 0 && options->histogram) {
+        histogram_map(&source_histogram, options->channel_order, &options->lut, &result_histogram);
+        result = write_histogram_report(&source_histogram, &result_histogram);
+    }
+    return result;
+}
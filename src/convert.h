@@ -0,0 +1,90 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bmp_header.h"
+#include "bmpneg.h"
+#include "histogram.h"
+#include "pipeline.h"
+#include "preview.h"
+
+#define MAX_GEOMETRY_OPS     32
+
+//Operations that move pixels (--op flipv, crop=..., rotate90...), kept in the order they were given.
+//Rotations are stored as a transpose followed by flips.
+typedef enum { GEOMETRY_FLIP_VERTICAL, GEOMETRY_FLIP_HORIZONTAL, GEOMETRY_TRANSPOSE, GEOMETRY_CROP } geometry_kind;
+
+typedef struct {
+    geometry_kind kind;
+    bmp_region crop;
+} geometry_op;
+
+typedef struct {
+    int theirs;     //Convert with qdbmp instead of our own code
+    int use_region;     //Convert only region, copying the rest of the image
+    bmp_region region;
+    int perf_counters;      //Report hardware performance counters per phase (command line only)
+    const char *preview_name;       //Also write a downscaled copy of the converted image there
+    unsigned int preview_scale;
+    int direct_output;      //Bypass the page cache when writing the pixels (--direct)
+    unsigned int compression;       //0, BMP_RLE8 or BMP_RLE4 for the pixels of 8-bit images
+    int gray;       //Write a 24-bit image as 8-bit luma with a gray palette (--gray)
+    unsigned int palette_colors;        //Write a 24-bit image as 8-bit with a palette of this size (--quantize), or 0
+    int histogram;      //Print the histograms of the input and the result on stdout (--histogram)
+    int auto_levels;        //Stretch every channel of the source to the full range before the lut (--auto-levels)
+    uint8_t channel_order[3];       //Channel c of a result pixel is channel channel_order[c] of the source (--op swap)
+    bmpneg_lut lut;     //Applied to the colors after channel_order, the negative unless operations were given
+    geometry_op geometry[MAX_GEOMETRY_OPS];
+    unsigned int geometry_count;
+    const char *input_name;
+    const char *output_name;
+    int output_fd;      //Output descriptor passed to the service (output_name is its /proc path), or -1
+} convert_options;
+
+//State of one conversion handed to the band transforms
+typedef struct {
+    uint32_t *header;
+    const convert_options *options;
+    preview_writer *preview;        //NULL without --preview
+    const uint8_t *palette;     //Converted palette of an 8-bit image, 256 entries
+    image_histogram *histogram;     //Counted from the source rows of a 24-bit image, NULL when not needed
+    uint64_t *index_counts;     //Of the palette indexes of an 8-bit image, NULL when not needed
+} convert_context;
+
+//Apply channel_order and the lookup table of options to rows of 24-bit pixels or to palette entries
+void apply_colors_24bit_rows (uint8_t *rows, unsigned int count, unsigned int width, const convert_options *options);
+void apply_colors_palette (uint8_t *palette, unsigned int colors, const convert_options *options);
+
+int stream_pixel_array (FILE *input_file, FILE *output_file, uint32_t *header,
+                        band_transform_t transform, void *context, int direct_output);
+//Encodes the pixel array of an 8-bit image row by row while writing it and patches the size, depth and
+//compression fields of the header written before it. The preview of conversion is fed from the same rows.
+int write_rle_pixel_array (FILE *input_file, FILE *output_file, uint32_t *header, convert_context *conversion);
+//Header of an uncompressed 8-bit image of the size of the image described by header, with colors palette entries
+void indexed_header (const uint32_t *header, unsigned int colors, uint32_t *result_header);
+//Writes the header and the palette of an 8-bit image, the pixel array follows at the pixel array address of header
+int write_8bit_head (FILE *output_file, const uint32_t *header, const uint8_t *palette);
+//When histogram is not NULL, it receives the histogram of the source pixels, counted from the rows as they are converted
+int convert_8bit_to_negative (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options,
+                              image_histogram *histogram);
+void transform_24bit_band (uint8_t *band, unsigned int rows, void *context);
+//Only feeds the preview and the index counts, the pixels of an 8-bit image are not changed
+void inspect_8bit_band (uint8_t *band, unsigned int rows, void *context);
+int convert_24bit_to_negative (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options,
+                               image_histogram *histogram);
+//Copies the image (unless in_place) and converts the part of every row inside options->region with pread and pwrite,
+//so the I/O is proportional to the region. Only 24-bit images are supported.
+int convert_region (FILE *input_file, uint32_t *header, FILE *output_file, int in_place, const convert_options *options);
+int convert_to_negative_qdbmp (const char *input_name, FILE *output_file);
+
+void print_convert_usage (void);
+//Parses "--mine|--theirs [options] <input_file> <output_file>" (argv[0] is the mode).
+//Returns 0, or -1 after printing what is wrong.
+int parse_convert_arguments (int argc, char **argv, convert_options *options);
+
+//Runs the conversion described by options.
+//Returns the same codes as the command line tool: 0, -1, -2 (broken structure) or -3 (qdbmp error).
+int convert_files (const convert_options *options);
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_header.h"
+#include "convert.h"
+#include "geometry.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define GEOMETRY_BAND_BYTES     (1 << 20)
+#define TRANSPOSE_STRIP_BYTES     (64 << 20)      //Result rows of a transposed image built in memory at once
+#define TRANSPOSE_TILE     32      //Pixels on the side of the tiles moved by a transpose
+
+
+static size_t bytes_in_row (unsigned int width, unsigned int depth)
+{
+    if (depth == 24)
+        return (size_t)width * 3 + width % 4;
+    return width + (4 - width % 4) % 4;
+}
+
+
+//Cuts [start, start + length) of the result out of one axis of the rectangle
+static void crop_axis (unsigned int *origin, unsigned int *size, int flipped, unsigned int start, unsigned int length)
+{
+    *origin += flipped ? *size - start - length : start;
+    *size = length;
+}
+
+
+int resolve_geometry (const uint32_t *header, const convert_options *options, geometry_view *view)
+{
+    bmp_region crop;
+    unsigned int result_width, result_height;
+    memset(view, 0, sizeof(*view));
+    view->width = header[WIDTH_A];
+    view->height = abs((signed)header[HEIGHT_A]);
+    for (unsigned int i = 0; i < options->geometry_count; i++) {
+        switch (options->geometry[i].kind) {
+            case GEOMETRY_FLIP_VERTICAL:
+                *(view->transposed ? &view->flip_x : &view->flip_y) ^= 1;
+                continue;
+            case GEOMETRY_FLIP_HORIZONTAL:
+                *(view->transposed ? &view->flip_y : &view->flip_x) ^= 1;
+                continue;
+            case GEOMETRY_TRANSPOSE:
+                view->transposed ^= 1;
+                continue;
+            default:
+                break;
+        }
+        crop = options->geometry[i].crop;
+        result_width = view->transposed ? view->height : view->width;
+        result_height = view->transposed ? view->width : view->height;
+        if (crop.x >= result_width || crop.y >= result_height || crop.width == 0 || crop.height == 0) {
+            error("The crop %u,%u,%u,%u leaves nothing of the image", crop.x, crop.y, crop.width, crop.height);
+            return -1;
+        }
+        if (crop.width > result_width - crop.x)
+            crop.width = result_width - crop.x;
+        if (crop.height > result_height - crop.y)
+            crop.height = result_height - crop.y;
+        if (view->transposed) {
+            crop_axis(&view->y0, &view->height, view->flip_y, crop.x, crop.width);
+            crop_axis(&view->x0, &view->width, view->flip_x, crop.y, crop.height);
+        }
+        else {
+            crop_axis(&view->x0, &view->width, view->flip_x, crop.x, crop.width);
+            crop_axis(&view->y0, &view->height, view->flip_y, crop.y, crop.height);
+        }
+    }
+    return 0;
+}
+
+
+void geometry_header (const uint32_t *header, const geometry_view *view, uint32_t *result_header)
+{
+    unsigned int width = view->transposed ? view->height : view->width;
+    unsigned int height = view->transposed ? view->width : view->height;
+    size_t result_row = bytes_in_row(width, header[FORMAT_A] >> 16);
+    memcpy(result_header, header, sizeof(uint32_t) * HEADER_CELLS);
+    result_header[WIDTH_A] = width;
+    result_header[HEIGHT_A] = (signed)header[HEIGHT_A] < 0 ? -(int32_t)height : (int32_t)height;
+    result_header[IMAGE_SIZE_A] = result_row * height;
+    result_header[FILE_SIZE_A] = header[PIXEL_ARRAY_ADDRESS_A] + result_row * height;
+}
+
+
+//Writes the header and the colored palette of the result
+static int write_geometry_head (FILE *input_file, const uint32_t *result_header, FILE *output_file,
+                                const convert_options *options)
+{
+    uint16_t header_field = 0x4d42;
+    unsigned int bytes_in_palette_arr = result_header[PIXEL_ARRAY_ADDRESS_A] - HEADER_SIZE;
+    uint8_t palette[256 * 4];
+    perf_scope scope;
+    if ((result_header[FORMAT_A] >> 16) == 8) {
+        perf_phase_begin(&scope);
+        if (fread(palette, sizeof(uint8_t), bytes_in_palette_arr, input_file) != bytes_in_palette_arr) {
+            error(feof(input_file) ? "Palette read error. End of file." : "Palette read error.");
+            return -1;
+        }
+        apply_colors_palette(palette, result_header[NUMBER_OF_COLORS_IN_PALETTE_A], options);
+        perf_phase_end(&scope, PERF_PALETTE, bytes_in_palette_arr);
+    }
+    perf_phase_begin(&scope);
+    if (fwrite(&header_field, sizeof(uint16_t), 1, output_file) != 1 ||
+        fwrite(result_header, sizeof(uint8_t), HEADER_SIZE - 2, output_file) != HEADER_SIZE - 2 ||
+        ((result_header[FORMAT_A] >> 16) == 8 &&
+         fwrite(palette, sizeof(uint8_t), bytes_in_palette_arr, output_file) != bytes_in_palette_arr) ||
+        fflush(output_file)) {
+        error("Data writing error");
+        return -1;
+    }
+    perf_phase_end(&scope, PERF_WRITE, result_header[PIXEL_ARRAY_ADDRESS_A]);
+    return 0;
+}
+
+
+static void reverse_pixels (uint8_t *row, unsigned int width, size_t pixel_bytes)
+{
+    uint8_t pixel[3];
+    for (uint8_t *left = row, *right = row + (width - 1) * pixel_bytes; left < right;
+         left += pixel_bytes, right -= pixel_bytes) {
+        memcpy(pixel, left, pixel_bytes);
+        memcpy(left, right, pixel_bytes);
+        memcpy(right, pixel, pixel_bytes);
+    }
+}
+
+
+//Results that keep the axes: every result row is a segment of one source row
+static int convert_rows (FILE *input_file, const uint32_t *header, const uint32_t *result_header, FILE *output_file,
+                         const geometry_view *view, const convert_options *options)
+{
+    unsigned int depth = header[FORMAT_A] >> 16, rows = abs((signed)header[HEIGHT_A]), rows_per_band, count;
+    int top_down = (signed)header[HEIGHT_A] < 0, step, result = 0;
+    size_t source_row, result_row, bytes_in_segment, pixel_bytes = depth / 8;
+    long long base, first;
+    uint8_t *source_band, *result_band, *source;
+    perf_scope scope;
+    source_row = bytes_in_row(header[WIDTH_A], depth);
+    result_row = bytes_in_row(view->width, depth);
+    bytes_in_segment = view->width * pixel_bytes;
+    //Result row j of the file comes from source row base + step * j of the file, whatever the row orders are
+    step = view->flip_y ? -1 : 1;
+    if (top_down)
+        base = view->flip_y ? view->y0 + view->height - 1 : view->y0;
+    else
+        base = view->flip_y ? rows - 1 - view->y0 : rows - view->y0 - view->height;
+    rows_per_band = GEOMETRY_BAND_BYTES / (source_row > result_row ? source_row : result_row);
+    if (rows_per_band == 0)
+        rows_per_band = 1;
+    if (rows_per_band > view->height)
+        rows_per_band = view->height;
+    source_band = malloc((size_t)rows_per_band * source_row + 1);
+    //Zeroed once, so the padding of the result rows stays zero
+    result_band = calloc((size_t)rows_per_band * result_row + 1, 1);
+    if (source_band == NULL || result_band == NULL) {
+        error("Memory allocation error.");
+        free(source_band);
+        free(result_band);
+        return -1;
+    }
+    for (unsigned int j = 0; j < view->height && result == 0; j += count) {
+        count = view->height - j < rows_per_band ? view->height - j : rows_per_band;
+        first = step > 0 ? base + j : base - j - (count - 1);
+        perf_phase_begin(&scope);
+        result = pread_full(fileno(input_file), source_band, count * source_row,
+                            header[PIXEL_ARRAY_ADDRESS_A] + first * (long long)source_row);
+        perf_phase_end(&scope, PERF_PIXEL_READ, count * source_row);
+        if (result != 0) {
+            error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            result = -1;
+            break;
+        }
+        perf_phase_begin(&scope);
+        for (unsigned int k = 0; k < count; k++) {
+            source = source_band + (step > 0 ? k : count - 1 - k) * source_row + view->x0 * pixel_bytes;
+            memcpy(result_band + k * result_row, source, bytes_in_segment);
+            if (view->flip_x)
+                reverse_pixels(result_band + k * result_row, view->width, pixel_bytes);
+        }
+        if (depth == 24)
+            apply_colors_24bit_rows(result_band, count, view->width, options);
+        perf_phase_end(&scope, PERF_TRANSFORM, count * result_row);
+        perf_phase_begin(&scope);
+        if ((result = pwrite_full(fileno(output_file), result_band, count * result_row,
+                                  result_header[PIXEL_ARRAY_ADDRESS_A] + j * (long long)result_row)) != 0)
+            error("Data writing error");
+        perf_phase_end(&scope, PERF_WRITE, count * result_row);
+    }
+    free(source_band);
+    free(result_band);
+    return result;
+}
+
+
+//Moves rows x columns pixels of the source, walked along rows, to the result, where a source row becomes
+//a column: pixel (r, k) goes to result + k * row_step + r * column_step. Inlined with a constant pixel size,
+//so the pixel copies are plain moves.
+static inline void move_tiles (uint8_t *result, long row_step, long column_step, const uint8_t *source,
+                               size_t source_stride, unsigned int rows, unsigned int columns, const size_t pixel_bytes)
+{
+    for (unsigned int r0 = 0; r0 < rows; r0 += TRANSPOSE_TILE)
+        for (unsigned int k0 = 0; k0 < columns; k0 += TRANSPOSE_TILE) {
+            unsigned int r_end = r0 + TRANSPOSE_TILE < rows ? r0 + TRANSPOSE_TILE : rows;
+            unsigned int k_end = k0 + TRANSPOSE_TILE < columns ? k0 + TRANSPOSE_TILE : columns;
+            for (unsigned int r = r0; r < r_end; r++) {
+                const uint8_t *from = source + r * source_stride + k0 * pixel_bytes;
+                uint8_t *to = result + k0 * row_step + r * column_step;
+                for (unsigned int k = k0; k < k_end; k++, from += pixel_bytes, to += row_step)
+                    memcpy(to, from, pixel_bytes);
+            }
+        }
+}
+
+
+//Results with swapped axes: every result row is a column of the source. The result is built in strips of rows;
+//for every strip the source rows are read in bands, only the columns of the strip unless it spans whole rows.
+static int convert_transposed (FILE *input_file, const uint32_t *header, const uint32_t *result_header, FILE *output_file,
+                               const geometry_view *view, const convert_options *options)
+{
+    unsigned int depth = header[FORMAT_A] >> 16, rows = abs((signed)header[HEIGHT_A]);
+    unsigned int result_width = view->height, result_height = view->width, strip_rows, band_rows, count, rows_read;
+    int top_down = (signed)header[HEIGHT_A] < 0, whole_rows, result = 0;
+    size_t source_row = bytes_in_row(header[WIDTH_A], depth), result_row = bytes_in_row(result_width, depth);
+    size_t pixel_bytes = depth / 8, bytes_in_segment, stride;
+    long long first_file_row = top_down ? view->y0 : rows - view->y0 - view->height;
+    long row_step, column_step;
+    unsigned int first_column, x;
+    //Result row j shows source column x0 + u, where u is the result y (j or its mirror) mirrored by flip_x
+    int row_slope = (top_down ? 1 : -1) * (view->flip_x ? -1 : 1);
+    //Source file row f shows at result x v, where v is the source y (f or its mirror) mirrored by flip_y
+    int column_slope = (top_down ? 1 : -1) * (view->flip_y ? -1 : 1);
+    uint8_t *strip, *band, *target;
+    perf_scope scope;
+    strip_rows = TRANSPOSE_STRIP_BYTES / result_row;
+    if (strip_rows == 0)
+        strip_rows = 1;
+    if (strip_rows > result_height)
+        strip_rows = result_height;
+    band_rows = GEOMETRY_BAND_BYTES / (strip_rows * pixel_bytes < source_row ? strip_rows * pixel_bytes : source_row);
+    if (band_rows == 0)
+        band_rows = 1;
+    if (band_rows > view->height)
+        band_rows = view->height;
+    strip = calloc((size_t)strip_rows * result_row + 1, 1);
+    band = malloc((size_t)band_rows * source_row + 1);
+    if (strip == NULL || band == NULL) {
+        error("Memory allocation error.");
+        free(strip);
+        free(band);
+        return -1;
+    }
+    for (unsigned int j0 = 0; j0 < result_height && result == 0; j0 += count) {
+        count = result_height - j0 < strip_rows ? result_height - j0 : strip_rows;
+        //The columns of the strip are contiguous in the source
+        first_column = top_down ? j0 : result_height - j0 - count;
+        first_column = view->x0 + (view->flip_x ? view->width - first_column - count : first_column);
+        whole_rows = first_column == 0 && count == header[WIDTH_A];
+        bytes_in_segment = count * pixel_bytes;
+        stride = whole_rows ? source_row : bytes_in_segment;
+        for (unsigned int f = 0; f < view->height && result == 0; f += rows_read) {
+            rows_read = view->height - f < band_rows ? view->height - f : band_rows;
+            perf_phase_begin(&scope);
+            if (whole_rows)
+                result = pread_full(fileno(input_file), band, rows_read * source_row,
+                                    header[PIXEL_ARRAY_ADDRESS_A] + (first_file_row + f) * (long long)source_row);
+            for (unsigned int r = 0; !whole_rows && r < rows_read && result == 0; r++)
+                result = pread_full(fileno(input_file), band + r * bytes_in_segment, bytes_in_segment,
+                                    header[PIXEL_ARRAY_ADDRESS_A] + (first_file_row + f + r) * (long long)source_row +
+                                    first_column * (long long)pixel_bytes);
+            perf_phase_end(&scope, PERF_PIXEL_READ, rows_read * bytes_in_segment);
+            if (result != 0) {
+                error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+                result = -1;
+                break;
+            }
+            perf_phase_begin(&scope);
+            //Result x of the first row of the band and strip row of the first column of the segment
+            x = column_slope > 0 ? f : view->height - 1 - f;
+            row_step = row_slope > 0 ? (long)result_row : -(long)result_row;
+            column_step = column_slope > 0 ? (long)pixel_bytes : -(long)pixel_bytes;
+            target = strip + (row_slope > 0 ? 0 : (count - 1) * result_row) + x * pixel_bytes;
+            if (depth == 24)
+                move_tiles(target, row_step, column_step, band, stride, rows_read, count, 3);
+            else
+                move_tiles(target, row_step, column_step, band, stride, rows_read, count, 1);
+            perf_phase_end(&scope, PERF_TRANSFORM, rows_read * bytes_in_segment);
+        }
+        if (result != 0)
+            break;
+        perf_phase_begin(&scope);
+        if (depth == 24)
+            apply_colors_24bit_rows(strip, count, result_width, options);
+        perf_phase_end(&scope, PERF_TRANSFORM, count * result_row);
+        perf_phase_begin(&scope);
+        if ((result = pwrite_full(fileno(output_file), strip, count * result_row,
+                                  result_header[PIXEL_ARRAY_ADDRESS_A] + j0 * (long long)result_row)) != 0)
+            error("Data writing error");
+        perf_phase_end(&scope, PERF_WRITE, count * result_row);
+    }
+    free(strip);
+    free(band);
+    return result;
+}
+
+
+int convert_geometry (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options)
+{
+    uint32_t result_header[HEADER_CELLS];
+    geometry_view view;
+    if (resolve_geometry(header, options, &view))
+        return -1;
+    geometry_header(header, &view, result_header);
+    if (write_geometry_head(input_file, result_header, output_file, options))
+        return -1;
+    if (view.transposed)
+        return convert_transposed(input_file, header, result_header, output_file, &view, options);
+    return convert_rows(input_file, header, result_header, output_file, &view, options);
+}
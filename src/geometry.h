@@ -0,0 +1,33 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "convert.h"
+
+//The part of the source the geometric operations leave and its orientation, with y counted from the top row.
+//Pixel (x, y) of the result is (u, v) = transposed ? (y, x) : (x, y) of the rectangle at x0, y0
+//counted from its right or bottom edge when flip_x or flip_y is set.
+typedef struct {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int width;     //Of the rectangle in the source
+    unsigned int height;
+    int flip_x;
+    int flip_y;
+    int transposed;
+} geometry_view;
+
+//Folds the geometric operations of options over the image described by header, in the given order.
+//Crops are cut down to the image. Returns 0, or -1 after printing that nothing of the image is left.
+int resolve_geometry (const uint32_t *header, const convert_options *options, geometry_view *view);
+//Header of the result: the size fields describe view, the row order stays the one of the source
+void geometry_header (const uint32_t *header, const geometry_view *view, uint32_t *result_header);
+
+//Converts with the geometric operations in one pass. Without a transpose every band of result rows is read
+//from a contiguous run of source rows with pread (backwards for a vertical flip, so the image is never held whole).
+//Transposed results are built in strips of rows that fit in memory: the source columns of a strip are read
+//row by row and moved in small square tiles, so neither side is walked against its cache lines.
+int convert_geometry (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options);
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_header.h"
+#include "convert.h"
+#include "gray.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define GRAY_BAND_BYTES     (1 << 20)
+//BT.601 luma weights in 1/256: they add up to 256, so white stays 255 and the sums fit in 16 bits
+#define LUMA_BLUE     29
+#define LUMA_GREEN     150
+#define LUMA_RED     77
+
+
+//Fixed-point luma of a row. The sums are kept in 16 bits, so the loop vectorizes with twice
+//the lanes of 32-bit arithmetic (the blue, green and red bytes are deinterleaved by the compiler).
+static void luma_row (const uint8_t *restrict source, uint8_t *restrict result, unsigned int width)
+{
+    for (unsigned int x = 0; x < width; x++) {
+        uint16_t blue = source[3 * x], green = source[3 * x + 1], red = source[3 * x + 2];
+        result[x] = (uint8_t)((uint16_t)(LUMA_BLUE * blue + LUMA_GREEN * green + LUMA_RED * red + 128) >> 8);
+    }
+}
+
+
+//The tone operations shared by the three channels can be applied to the luma itself
+static int same_table_for_all (const convert_options *options)
+{
+    return !memcmp(options->lut.channel[0], options->lut.channel[1], 256) &&
+           !memcmp(options->lut.channel[0], options->lut.channel[2], 256);
+}
+
+
+static int identity_table (const uint8_t *table)
+{
+    for (int v = 0; v < 256; v++)
+        if (table[v] != v)
+            return 0;
+    return 1;
+}
+
+
+int convert_24bit_to_gray (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options)
+{
+    uint32_t result_header[HEADER_CELLS];
+    uint8_t palette[256 * 4], *source_band, *result_band;
+    unsigned int width = header[WIDTH_A], rows = abs((signed)header[HEIGHT_A]), rows_per_band, count;
+    size_t source_row = (size_t)width * 3 + width % 4, result_row = width + (4 - width % 4) % 4;
+    //The luma is mapped through table, NULL when the palette carries the tone operations or there are none
+    const uint8_t *table = NULL;
+    perf_scope scope;
+    int result = 0;
+    indexed_header(header, 256, result_header);
+    perf_phase_begin(&scope);
+    for (int i = 0; i < 256; i++) {
+        palette[4 * i] = palette[4 * i + 1] = palette[4 * i + 2] = (uint8_t)i;
+        palette[4 * i + 3] = 0;
+    }
+    if (same_table_for_all(options)) {
+        if (!identity_table(options->lut.channel[0]))
+            table = options->lut.channel[0];
+    }
+    else
+        apply_colors_palette(palette, 256, options);
+    perf_phase_end(&scope, PERF_PALETTE, sizeof(palette));
+    perf_phase_begin(&scope);
+    if (write_8bit_head(output_file, result_header, palette))
+        return -1;
+    perf_phase_end(&scope, PERF_WRITE, result_header[PIXEL_ARRAY_ADDRESS_A]);
+    rows_per_band = GRAY_BAND_BYTES / source_row;
+    if (rows_per_band == 0)
+        rows_per_band = 1;
+    if (rows_per_band > rows)
+        rows_per_band = rows;
+    source_band = malloc((size_t)rows_per_band * source_row + 1);
+    //Zeroed once, so the padding of the result rows stays zero
+    result_band = calloc((size_t)rows_per_band * result_row + 1, 1);
+    if (source_band == NULL || result_band == NULL) {
+        error("Memory allocation error.");
+        free(source_band);
+        free(result_band);
+        return -1;
+    }
+    //The rows keep their order, so band j of the result is band j of the source
+    for (unsigned int j = 0; j < rows; j += count) {
+        count = rows - j < rows_per_band ? rows - j : rows_per_band;
+        perf_phase_begin(&scope);
+        result = pread_full(fileno(input_file), source_band, count * source_row,
+                            header[PIXEL_ARRAY_ADDRESS_A] + j * (long long)source_row);
+        perf_phase_end(&scope, PERF_PIXEL_READ, count * source_row);
+        if (result != 0) {
+            error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            result = -1;
+            break;
+        }
+        perf_phase_begin(&scope);
+        for (unsigned int k = 0; k < count; k++) {
+            uint8_t *gray = result_band + k * result_row;
+            luma_row(source_band + k * source_row, gray, width);
+            for (unsigned int x = 0; table != NULL && x < width; x++)
+                gray[x] = table[gray[x]];
+        }
+        perf_phase_end(&scope, PERF_TRANSFORM, count * source_row);
+        perf_phase_begin(&scope);
+        if ((result = pwrite_full(fileno(output_file), result_band, count * result_row,
+                                  result_header[PIXEL_ARRAY_ADDRESS_A] + j * (long long)result_row)) != 0)
+            error("Data writing error");
+        perf_phase_end(&scope, PERF_WRITE, count * result_row);
+        if (result != 0)
+            break;
+    }
+    free(source_band);
+    free(result_band);
+    return result;
+}
@@ -0,0 +1,12 @@
+#ifndef GRAY_H
+#define GRAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "convert.h"
+
+//--gray: writes the luma of every pixel of a 24-bit image as an index into a gray palette (index i is the gray i).
+//Tone operations that treat the channels alike are applied to the luma in the same pass, others color the palette.
+int convert_24bit_to_gray (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options);
+
+#endif
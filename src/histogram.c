@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bmp_header.h"
+#include "histogram.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define HISTOGRAM_BAND_BYTES     (1 << 20)
+
+
+//Every call counts into four copies of the bins, a pixel in four to each, so runs of equal values do not wait
+//on the increment of one counter. A pixel array is smaller than 4 GiB, so 32-bit counters do not overflow.
+void histogram_add_24bit_rows (image_histogram *histogram, const uint8_t *rows, unsigned int count, unsigned int width)
+{
+    uint32_t bins[4][3][256];
+    size_t bytes_in_row = (size_t)width * 3 + width % 4;
+    const uint8_t *p, *end;
+    memset(bins, 0, sizeof(bins));
+    for (unsigned int j = 0; j < count; j++, rows += bytes_in_row) {
+        end = rows + (size_t)width * 3;
+        for (p = rows; p + 12 <= end; p += 12)
+            for (int k = 0; k < 4; k++) {
+                bins[k][0][p[3 * k]]++;
+                bins[k][1][p[3 * k + 1]]++;
+                bins[k][2][p[3 * k + 2]]++;
+            }
+        for (; p < end; p += 3) {
+            bins[0][0][p[0]]++;
+            bins[0][1][p[1]]++;
+            bins[0][2][p[2]]++;
+        }
+    }
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            histogram->count[c][v] += (uint64_t)bins[0][c][v] + bins[1][c][v] + bins[2][c][v] + bins[3][c][v];
+}
+
+
+void histogram_add_indexes (uint64_t *counts, const uint8_t *rows, unsigned int count, unsigned int width)
+{
+    uint32_t bins[4][256];
+    size_t bytes_in_row = width + (4 - width % 4) % 4;
+    unsigned int x;
+    memset(bins, 0, sizeof(bins));
+    for (unsigned int j = 0; j < count; j++, rows += bytes_in_row) {
+        for (x = 0; x + 4 <= width; x += 4)
+            for (int k = 0; k < 4; k++)
+                bins[k][rows[x + k]]++;
+        for (; x < width; x++)
+            bins[0][rows[x]]++;
+    }
+    for (int v = 0; v < 256; v++)
+        counts[v] += (uint64_t)bins[0][v] + bins[1][v] + bins[2][v] + bins[3][v];
+}
+
+
+void histogram_add_palette (image_histogram *histogram, const uint64_t *counts, const uint8_t *palette)
+{
+    for (int i = 0; i < 256; i++)
+        for (int c = 0; c < 3; c++)
+            histogram->count[c][palette[4 * i + c]] += counts[i];
+}
+
+
+//Every value of a source channel becomes one value of a result channel, so its pixels move together
+void histogram_map (const image_histogram *source, const uint8_t *channel_order, const bmpneg_lut *lut,
+                    image_histogram *result)
+{
+    memset(result, 0, sizeof(*result));
+    for (int c = 0; c < 3; c++)
+        for (int v = 0; v < 256; v++)
+            result->count[c][lut->channel[c][v]] += source->count[channel_order[c]][v];
+}
+
+
+//The rows of the pixel array one worker thread counts into a histogram of its own
+typedef struct {
+    int input_fd;
+    const uint32_t *header;
+    unsigned int first;
+    unsigned int count;
+    image_histogram histogram;      //Of a 24-bit image
+    uint64_t indexes[256];      //Of an 8-bit image
+    int result;
+} histogram_job;
+
+
+static void *scan_rows (void *argument)
+{
+    histogram_job *job = argument;
+    unsigned int width = job->header[WIDTH_A], depth = job->header[FORMAT_A] >> 16, rows_per_band, count;
+    size_t bytes_in_row = depth == 24 ? (size_t)width * 3 + width % 4 : width + (4 - width % 4) % 4;
+    long long offset = job->header[PIXEL_ARRAY_ADDRESS_A] + (long long)job->first * bytes_in_row;
+    uint8_t *band;
+    perf_scope scope;
+    int result;
+    rows_per_band = bytes_in_row < HISTOGRAM_BAND_BYTES ? HISTOGRAM_BAND_BYTES / bytes_in_row : 1;
+    if ((band = malloc((size_t)rows_per_band * bytes_in_row + 1)) == NULL) {
+        error("Memory allocation error.");
+        job->result = -1;
+        return NULL;
+    }
+    for (unsigned int i = 0; i < job->count; i += count, offset += (long long)count * bytes_in_row) {
+        count = job->count - i < rows_per_band ? job->count - i : rows_per_band;
+        perf_phase_begin(&scope);
+        result = pread_full(job->input_fd, band, count * bytes_in_row, offset);
+        perf_phase_end(&scope, PERF_PIXEL_READ, count * bytes_in_row);
+        if (result != 0) {
+            error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            job->result = -1;
+            break;
+        }
+        perf_phase_begin(&scope);
+        if (depth == 24)
+            histogram_add_24bit_rows(&job->histogram, band, count, width);
+        else
+            histogram_add_indexes(job->indexes, band, count, width);
+        perf_phase_end(&scope, PERF_TRANSFORM, count * bytes_in_row);
+    }
+    free(band);
+    perf_counters_release_thread();
+    return NULL;
+}
+
+
+int histogram_scan (int input_fd, const uint32_t *header, image_histogram *histogram)
+{
+    pthread_t threads[HISTOGRAM_MAX_THREADS];
+    int started[HISTOGRAM_MAX_THREADS];
+    uint8_t palette[256 * 4] = { 0 };
+    unsigned int rows = abs((signed)header[HEIGHT_A]), colors = header[NUMBER_OF_COLORS_IN_PALETTE_A], threads_count;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    histogram_job *jobs;
+    int result = 0;
+    memset(histogram, 0, sizeof(*histogram));
+    //Indexes outside a short palette read black, as in the conversion
+    if ((header[FORMAT_A] >> 16) == 8 && (result = pread_full(input_fd, palette, colors * 4, HEADER_SIZE)) != 0) {
+        error(result > 0 ? "Palette read error. End of file." : "Palette read error.");
+        return -1;
+    }
+    threads_count = online < 1 ? 1 : online > HISTOGRAM_MAX_THREADS ? HISTOGRAM_MAX_THREADS : (unsigned int)online;
+    if (threads_count > rows)
+        threads_count = rows ? rows : 1;
+    if ((jobs = calloc(threads_count, sizeof(histogram_job))) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads_count; t++) {
+        jobs[t].input_fd = input_fd;
+        jobs[t].header = header;
+        jobs[t].first = (unsigned int)((unsigned long long)rows * t / threads_count);
+        jobs[t].count = (unsigned int)((unsigned long long)rows * (t + 1) / threads_count) - jobs[t].first;
+    }
+    //The calling thread takes the first share, and any share whose thread can not be started
+    for (unsigned int t = 1; t < threads_count; t++)
+        started[t] = pthread_create(&threads[t], NULL, scan_rows, &jobs[t]) == 0;
+    scan_rows(&jobs[0]);
+    for (unsigned int t = 1; t < threads_count; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            scan_rows(&jobs[t]);
+    }
+    for (unsigned int t = 0; t < threads_count; t++) {
+        result |= jobs[t].result;
+        for (int c = 0; c < 3; c++)
+            for (int v = 0; v < 256; v++)
+                histogram->count[c][v] += jobs[t].histogram.count[c][v];
+        if ((header[FORMAT_A] >> 16) == 8)
+            histogram_add_palette(histogram, jobs[t].indexes, palette);
+    }
+    free(jobs);
+    return result ? -1 : 0;
+}
+
+
+void histogram_levels (const image_histogram *histogram, bmpneg_lut *stretch)
+{
+    uint64_t total = 0, clip, below;
+    int low, high;
+    for (int v = 0; v < 256; v++)
+        total += histogram->count[0][v];
+    clip = total / HISTOGRAM_LEVELS_CLIP;
+    bmpneg_lut_identity(stretch);
+    for (int c = 0; c < 3; c++) {
+        low = 0;
+        below = histogram->count[c][0];
+        while (low < 255 && below <= clip)
+            below += histogram->count[c][++low];
+        high = 255;
+        below = histogram->count[c][255];
+        while (high > 0 && below <= clip)
+            below += histogram->count[c][--high];
+        //A channel of one value (after clipping) has nothing to stretch
+        if (low >= high)
+            continue;
+        for (int v = 0; v < 256; v++)
+            stretch->channel[c][v] = v <= low ? 0 : v >= high ? 255 : ((v - low) * 255 + (high - low) / 2) / (high - low);
+    }
+}
+
+
+static int write_all (int fd, const char *buffer, size_t size)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = write(fd, buffer, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        buffer += done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+//The report is formatted in one buffer and written with one call, like the reports of comparer
+int write_histogram_report (const image_histogram *input, const image_histogram *output)
+{
+    static const char *names[3] = { "blue", "green", "red" };
+    const image_histogram *images[2] = { input, output };
+    uint64_t total, sum;
+    int low, high, result;
+    char *buffer, *out;
+    //A count has 20 digits at most
+    if ((buffer = malloc(6 * (128 + 256 * 21))) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    out = buffer;
+    for (int i = 0; i < 2; i++)
+        for (int c = 0; c < 3; c++) {
+            const uint64_t *count = images[i]->count[c];
+            total = sum = 0;
+            low = 255;
+            high = 0;
+            for (int v = 0; v < 256; v++) {
+                if (count[v] == 0)
+                    continue;
+                total += count[v];
+                sum += count[v] * v;
+                low = v < low ? v : low;
+                high = v;
+            }
+            if (total == 0)
+                low = 0;
+            out += sprintf(out, "%s %s min %d max %d mean %.3f counts", i ? "output" : "input", names[c], low, high,
+                           total ? (double)sum / total : 0.0);
+            for (int v = 0; v < 256; v++)
+                out += sprintf(out, " %llu", (unsigned long long)count[v]);
+            *out++ = '\n';
+        }
+    fflush(stdout);
+    if ((result = write_all(STDOUT_FILENO, buffer, out - buffer)) != 0)
+        error("Histogram writing error");
+    free(buffer);
+    return result;
+}
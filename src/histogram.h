@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include "bmpneg.h"
+
+#define HISTOGRAM_MAX_THREADS     16
+#define HISTOGRAM_LEVELS_CLIP     200     //--auto-levels ignores 1/200 of the pixels at each end of a channel
+
+//Number of pixels of every value of every channel, channels in pixel order (blue, green, red)
+typedef struct {
+    uint64_t count[3][256];
+} image_histogram;
+
+//Count the pixels of count rows of a 24-bit image, or the palette indexes of count rows of an 8-bit image
+void histogram_add_24bit_rows (image_histogram *histogram, const uint8_t *rows, unsigned int count, unsigned int width);
+void histogram_add_indexes (uint64_t *counts, const uint8_t *rows, unsigned int count, unsigned int width);
+//Adds the colors of index counts through a palette of 256 4-byte entries
+void histogram_add_palette (image_histogram *histogram, const uint64_t *counts, const uint8_t *palette);
+//The histogram of the pixels of source after channel_order and lut (see convert_options), without a pixel pass
+void histogram_map (const image_histogram *source, const uint8_t *channel_order, const bmpneg_lut *lut,
+                    image_histogram *result);
+
+//Reads the pixel array of the 8-bit or 24-bit image described by header once: worker threads count their rows
+//into private histograms, which are summed. Returns 0, or -1 after printing what is wrong.
+int histogram_scan (int input_fd, const uint32_t *header, image_histogram *histogram);
+
+//--auto-levels: per-channel tables that stretch the values between the clipped ends of histogram to 0..255
+void histogram_levels (const image_histogram *histogram, bmpneg_lut *stretch);
+
+//--histogram: prints "<input|output> <blue|green|red> min <v> max <v> mean <v> counts <256 counts>" on stdout,
+//a line per channel of each image. Returns 0 or -1.
+int write_histogram_report (const image_histogram *input, const image_histogram *output);
+
+#endif
@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "atomic_output.h"
+#include "bmp_header.h"
+#include "compare.h"
+#include "image_index.h"
+#include "perf_counters.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define INDEX_BAND_BYTES     (1 << 20)
+#define INDEX_HEADER_BYTES     16      //Magic, version, number of records and size of the names
+#define HASH_GRID     8       //Cells on the side of the grid of the perceptual hash
+#define HASH_MULTIPLIER     0x9e3779b97f4a7c15ULL
+
+
+//Finalizer of MurmurHash3: every input bit flips about half of the output bits
+static uint64_t mix64 (uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+
+//Hash of the colors of a row, 8 bytes at a time
+static uint64_t hash_row (const uint8_t *colors, size_t size)
+{
+    uint64_t hash = size, word;
+    for (; size >= 8; size -= 8, colors += 8) {
+        memcpy(&word, colors, 8);
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    word = 0;
+    memcpy(&word, colors, size);
+    return mix64(hash ^ word);
+}
+
+
+static unsigned int luma (const uint8_t *color)
+{
+    return (29 * color[0] + 150 * color[1] + 77 * color[2]) >> 8;
+}
+
+
+//The state of signing one image
+typedef struct {
+    unsigned int width;
+    unsigned int rows;
+    uint8_t palette[256 * 3];       //8-bit images: the colors of the entries, black past the palette
+    uint8_t *colors;        //8-bit images: a row with the palette resolved
+    uint8_t *grid_column;       //Column of the hash grid of every pixel column
+    uint64_t pixels_in_column[HASH_GRID];
+    uint64_t luma_sums[HASH_GRID * HASH_GRID];
+    uint64_t pixels[HASH_GRID * HASH_GRID];
+    uint64_t digest;
+} image_signer;
+
+
+//Adds the row at image row y (from the top) to the digest and the luma sums
+static void sign_row (image_signer *signer, const uint8_t *row, int depth, unsigned int y)
+{
+    unsigned int grid_row = (unsigned long long)y * HASH_GRID / signer->rows;
+    uint64_t sums[HASH_GRID] = { 0 };
+    const uint8_t *colors = row;
+    if (depth == 8) {
+        for (unsigned int x = 0; x < signer->width; x++)
+            memcpy(signer->colors + 3 * x, signer->palette + 3 * row[x], 3);
+        colors = signer->colors;
+    }
+    //Rows are combined by a sum, so they may come in the order of the file
+    signer->digest += mix64(hash_row(colors, (size_t)signer->width * 3) ^ (y + 1) * HASH_MULTIPLIER);
+    for (unsigned int x = 0; x < signer->width; x++)
+        sums[signer->grid_column[x]] += luma(colors + 3 * x);
+    for (int c = 0; c < HASH_GRID; c++) {
+        signer->luma_sums[grid_row * HASH_GRID + c] += sums[c];
+        signer->pixels[grid_row * HASH_GRID + c] += signer->pixels_in_column[c];
+    }
+}
+
+
+//Average hash of the grid: the bits of the cells brighter than the mean of the cells
+static uint64_t perceptual_hash (const image_signer *signer)
+{
+    uint64_t means[HASH_GRID * HASH_GRID], total = 0, hash = 0;
+    unsigned int cells = 0;
+    for (int i = 0; i < HASH_GRID * HASH_GRID; i++) {
+        //In 1/256 of a level, cells without pixels (images smaller than the grid) stay out
+        means[i] = signer->pixels[i] ? (signer->luma_sums[i] << 8) / signer->pixels[i] : 0;
+        if (signer->pixels[i]) {
+            total += means[i];
+            cells++;
+        }
+    }
+    for (int i = 0; i < HASH_GRID * HASH_GRID; i++)
+        if (signer->pixels[i] && means[i] * cells > total)
+            hash |= 1ULL << i;
+    return hash;
+}
+
+
+//Reads the image name and fills the digest, hash, size and depth of signature.
+//Returns 0, or a negative code after printing what is wrong.
+static int sign_image (const char *name, image_signature *signature)
+{
+    uint32_t header[HEADER_CELLS];
+    uint8_t entries[256 * 4], *band = NULL;
+    unsigned int depth, colors, rows_per_band, count;
+    size_t bytes_in_row;
+    int top_down, result;
+    image_signer signer;
+    perf_scope scope;
+    FILE *file;
+    if ((file = fopen(name, "rb")) == NULL) {
+        error("Can not open %s", name);
+        return -1;
+    }
+    perf_phase_begin(&scope);
+    result = read_and_check_header(header, file, name);
+    perf_phase_end(&scope, PERF_HEADER, HEADER_SIZE);
+    if (result != 0) {
+        fclose(file);
+        return result;
+    }
+    memset(&signer, 0, sizeof(signer));
+    signer.width = header[WIDTH_A];
+    signer.rows = abs((signed)header[HEIGHT_A]);
+    depth = header[FORMAT_A] >> 16;
+    top_down = (signed)header[HEIGHT_A] < 0;
+    bytes_in_row = depth == 24 ? (size_t)signer.width * 3 + signer.width % 4 : signer.width + (4 - signer.width % 4) % 4;
+    if (depth == 8) {
+        colors = header[NUMBER_OF_COLORS_IN_PALETTE_A];
+        if (fread(entries, sizeof(uint8_t), colors * 4, file) != colors * 4) {
+            error("Palette read error. File: %s", name);
+            fclose(file);
+            return -1;
+        }
+        for (unsigned int i = 0; i < colors; i++)
+            memcpy(signer.palette + 3 * i, entries + 4 * i, 3);
+    }
+    rows_per_band = INDEX_BAND_BYTES / bytes_in_row ? INDEX_BAND_BYTES / bytes_in_row : 1;
+    if (rows_per_band > signer.rows)
+        rows_per_band = signer.rows;
+    signer.grid_column = malloc(signer.width + 1);
+    signer.colors = malloc((size_t)signer.width * 3 + 1);
+    band = malloc(rows_per_band * bytes_in_row + 1);
+    if (signer.grid_column == NULL || signer.colors == NULL || band == NULL) {
+        error("Memory allocation error.");
+        result = -1;
+    }
+    else if (fseek(file, header[PIXEL_ARRAY_ADDRESS_A], SEEK_SET)) {
+        error("fseek() error. File: %s", name);
+        result = -1;
+    }
+    for (unsigned int x = 0; result == 0 && x < signer.width; x++) {
+        signer.grid_column[x] = (uint8_t)((unsigned long long)x * HASH_GRID / signer.width);
+        signer.pixels_in_column[signer.grid_column[x]]++;
+    }
+    for (unsigned int f = 0; result == 0 && f < signer.rows; f += count) {
+        count = signer.rows - f < rows_per_band ? signer.rows - f : rows_per_band;
+        perf_phase_begin(&scope);
+        if (fread(band, sizeof(uint8_t), count * bytes_in_row, file) != count * bytes_in_row) {
+            error(feof(file) ? "Pixel array read error. End of file. File: %s" : "Pixel array read error. File: %s", name);
+            result = -1;
+            break;
+        }
+        perf_phase_end(&scope, PERF_PIXEL_READ, count * bytes_in_row);
+        perf_phase_begin(&scope);
+        for (unsigned int k = 0; k < count; k++)
+            sign_row(&signer, band + k * bytes_in_row, depth, top_down ? f + k : signer.rows - 1 - (f + k));
+        perf_phase_end(&scope, PERF_TRANSFORM, count * bytes_in_row);
+    }
+    if (result == 0) {
+        signature->digest = mix64(signer.digest ^ ((uint64_t)signer.width << 32 | signer.rows) ^ (uint64_t)depth << 56);
+        signature->perceptual_hash = perceptual_hash(&signer);
+        signature->width = signer.width;
+        signature->height = signer.rows;
+        signature->depth = depth;
+    }
+    free(signer.grid_column);
+    free(signer.colors);
+    free(band);
+    fclose(file);
+    return result;
+}
+
+
+typedef struct {
+    image_signature *signatures;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    unsigned long long skipped;
+} index_builder;
+
+
+static int add_image (index_builder *builder, const char *name)
+{
+    image_signature signature;
+    size_t length = strlen(name) + 1;
+    void *grown;
+    if (sign_image(name, &signature)) {
+        error(" - skipped\n");
+        builder->skipped++;
+        return 0;
+    }
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity ? 2 * builder->capacity : 1024;
+        if ((grown = realloc(builder->signatures, builder->capacity * sizeof(image_signature))) == NULL) {
+            error("Memory allocation error.");
+            return -1;
+        }
+        builder->signatures = grown;
+    }
+    while (builder->names_size + length > builder->names_capacity) {
+        builder->names_capacity = builder->names_capacity ? 2 * builder->names_capacity : 65536;
+        if ((grown = realloc(builder->names, builder->names_capacity)) == NULL) {
+            error("Memory allocation error.");
+            return -1;
+        }
+        builder->names = grown;
+    }
+    if (builder->names_size + length > UINT32_MAX) {
+        error("The names of the images do not fit in an index");
+        return -1;
+    }
+    signature.name_offset = (uint32_t)builder->names_size;
+    memcpy(builder->names + builder->names_size, name, length);
+    builder->names_size += length;
+    builder->signatures[builder->count++] = signature;
+    return 0;
+}
+
+
+static int has_bmp_extension (const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && !strcasecmp(name + length - 4, ".bmp");
+}
+
+
+//Adds the images under path, which holds length characters and has room for PATH_MAX.
+//Directories that can not be read are skipped. Returns 0, or -1 when the index can not be built.
+static int walk_directory (index_builder *builder, char *path, size_t length)
+{
+    struct dirent *entry;
+    struct stat status;
+    size_t name_length;
+    int result = 0, type;
+    DIR *directory;
+    if ((directory = opendir(path)) == NULL) {
+        error("Can not open the directory %s: %s - skipped\n", path, strerror(errno));
+        return 0;
+    }
+    while (result == 0 && (entry = readdir(directory)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        name_length = strlen(entry->d_name);
+        if (length + 1 + name_length >= PATH_MAX) {
+            error("The path of %s in %s is too long - skipped\n", entry->d_name, path);
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, entry->d_name, name_length + 1);
+        type = entry->d_type;
+        if (type == DT_UNKNOWN && lstat(path, &status) == 0)
+            type = S_ISDIR(status.st_mode) ? DT_DIR : S_ISREG(status.st_mode) ? DT_REG : DT_UNKNOWN;
+        if (type == DT_DIR)
+            result = walk_directory(builder, path, length + 1 + name_length);
+        else if (type == DT_REG && has_bmp_extension(entry->d_name))
+            result = add_image(builder, path);
+        path[length] = '\0';
+    }
+    closedir(directory);
+    return result;
+}
+
+
+static int compare_digests (const void *first, const void *second)
+{
+    uint64_t a = ((const image_signature *)first)->digest, b = ((const image_signature *)second)->digest;
+    return a < b ? -1 : a > b;
+}
+
+
+static int write_index (const index_builder *builder, const char *index_name)
+{
+    uint32_t header[INDEX_HEADER_BYTES / 4];
+    atomic_output output;
+    size_t records = builder->count * sizeof(image_signature);
+    memcpy(header, INDEX_MAGIC, 4);
+    header[1] = INDEX_VERSION;
+    header[2] = (uint32_t)builder->count;
+    header[3] = (uint32_t)builder->names_size;
+    if (atomic_output_open(&output, index_name, INDEX_HEADER_BYTES + records + builder->names_size, 0))
+        return -1;
+    if (fwrite(header, sizeof(uint8_t), INDEX_HEADER_BYTES, output.file) != INDEX_HEADER_BYTES ||
+        fwrite(builder->signatures, sizeof(uint8_t), records, output.file) != records ||
+        fwrite(builder->names, sizeof(uint8_t), builder->names_size, output.file) != builder->names_size) {
+        error("Index writing error");
+        atomic_output_abort(&output);
+        return -1;
+    }
+    return atomic_output_commit(&output);
+}
+
+
+int build_image_index (const char *directory, const char *index_name)
+{
+    index_builder builder;
+    char path[PATH_MAX];
+    size_t length = strlen(directory);
+    struct stat status;
+    int result;
+    if (length >= PATH_MAX || stat(directory, &status) || !S_ISDIR(status.st_mode)) {
+        error("%s is not a directory", directory);
+        return -1;
+    }
+    memcpy(path, directory, length + 1);
+    while (length > 1 && path[length - 1] == '/')
+        path[--length] = '\0';
+    memset(&builder, 0, sizeof(builder));
+    result = walk_directory(&builder, path, length);
+    if (result == 0 && builder.count > UINT32_MAX) {
+        error("Too many images for one index");
+        result = -1;
+    }
+    if (result == 0) {
+        //Sorted by digest, a query finds the identical images by binary search
+        qsort(builder.signatures, builder.count, sizeof(image_signature), compare_digests);
+        result = write_index(&builder, index_name);
+    }
+    if (result == 0)
+        error("Indexed %zu images, skipped %llu files\n", builder.count, builder.skipped);
+    free(builder.signatures);
+    free(builder.names);
+    return result;
+}
+
+
+typedef struct {
+    uint8_t *data;
+    const image_signature *signatures;
+    uint32_t count;
+    const char *names;
+} image_index;
+
+
+static int load_index (image_index *index, const char *index_name)
+{
+    uint32_t header[INDEX_HEADER_BYTES / 4];
+    long size;
+    FILE *file;
+    memset(index, 0, sizeof(*index));
+    if ((file = fopen(index_name, "rb")) == NULL) {
+        error("%s not found", index_name);
+        return -1;
+    }
+    if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET)) {
+        error("File read error. File: %s", index_name);
+        fclose(file);
+        return -1;
+    }
+    //The records follow the header at an offset of 16, so they stay aligned in a malloc block
+    if ((index->data = malloc(size + 1)) == NULL) {
+        error("Memory allocation error.");
+        fclose(file);
+        return -1;
+    }
+    if (fread(index->data, sizeof(uint8_t), size, file) != (size_t)size) {
+        error("File read error. File: %s", index_name);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    if (size >= INDEX_HEADER_BYTES)
+        memcpy(header, index->data, INDEX_HEADER_BYTES);
+    if (size < INDEX_HEADER_BYTES || memcmp(header, INDEX_MAGIC, 4) || header[1] != INDEX_VERSION ||
+        (unsigned long long)size != INDEX_HEADER_BYTES + (unsigned long long)header[2] * sizeof(image_signature) + header[3] ||
+        (header[3] != 0 && index->data[size - 1] != '\0')) {
+        error("%s is not an image index of this version", index_name);
+        return -2;
+    }
+    index->count = header[2];
+    index->signatures = (const image_signature *)(index->data + INDEX_HEADER_BYTES);
+    index->names = (const char *)index->data + INDEX_HEADER_BYTES + index->count * sizeof(image_signature);
+    for (uint32_t i = 0; i < index->count; i++)
+        if (index->signatures[i].name_offset >= header[3]) {
+            error("%s is not an image index of this version", index_name);
+            return -2;
+        }
+    return 0;
+}
+
+
+//Returns the differing pixels of two images, or -1 after printing what is wrong
+static long long compare_candidate (const char *image_name, const char *candidate_name, unsigned int tolerance)
+{
+    uint32_t first_header[HEADER_CELLS], second_header[HEADER_CELLS];
+    FILE *first, *second;
+    long long mismatches = -1;
+    if ((first = fopen(image_name, "rb")) == NULL) {
+        error("%s not found\n", image_name);
+        return -1;
+    }
+    if ((second = fopen(candidate_name, "rb")) == NULL) {
+        error("%s not found\n", candidate_name);
+        fclose(first);
+        return -1;
+    }
+    if (read_and_check_header(first_header, first, image_name) == 0 &&
+        read_and_check_header(second_header, second, candidate_name) == 0)
+        mismatches = count_differing_pixels(first_header, first, second_header, second, tolerance);
+    fclose(first);
+    fclose(second);
+    return mismatches;
+}
+
+
+static int same_layout (const image_signature *first, const image_signature *second)
+{
+    return first->width == second->width && first->height == second->height && first->depth == second->depth;
+}
+
+
+typedef struct {
+    unsigned int distance;
+    uint32_t record;
+} near_candidate;
+
+
+static int compare_distances (const void *first, const void *second)
+{
+    const near_candidate *a = first, *b = second;
+    if (a->distance != b->distance)
+        return a->distance < b->distance ? -1 : 1;
+    return a->record < b->record ? -1 : a->record > b->record;
+}
+
+
+int query_image_index (const char *index_name, const char *image_name, const compare_options *options)
+{
+    image_index index;
+    image_signature query;
+    const image_signature *record;
+    near_candidate *candidates = NULL;
+    uint8_t *exact = NULL;
+    uint32_t low, high, middle, count = 0;
+    unsigned int distance;
+    long long mismatches;
+    int result, found = 0;
+    if ((result = load_index(&index, index_name)) != 0) {
+        free(index.data);
+        return result;
+    }
+    if ((result = sign_image(image_name, &query)) != 0 ||
+        (exact = calloc(index.count + 1, 1)) == NULL || (candidates = malloc((index.count + 1) * sizeof(*candidates))) == NULL) {
+        if (result == 0)
+            error("Memory allocation error.");
+        free(exact);
+        free(index.data);
+        return result ? result : -1;
+    }
+    low = 0;
+    high = index.count;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (index.signatures[middle].digest < query.digest)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    //An equal digest is only a candidate: the pixels decide
+    for (uint32_t i = low; i < index.count && index.signatures[i].digest == query.digest; i++) {
+        record = &index.signatures[i];
+        if (!same_layout(record, &query))
+            continue;
+        if ((mismatches = compare_candidate(image_name, index.names + record->name_offset, 0)) == 0) {
+            printf("exact %s\n", index.names + record->name_offset);
+            exact[i] = 1;
+            found = 1;
+        }
+    }
+    //A linear scan: 64-bit xor and popcount over the records costs less than reading one image
+    for (uint32_t i = 0; i < index.count; i++) {
+        record = &index.signatures[i];
+        distance = __builtin_popcountll(record->perceptual_hash ^ query.perceptual_hash);
+        if (distance <= options->max_distance && !exact[i] && same_layout(record, &query)) {
+            candidates[count].distance = distance;
+            candidates[count++].record = i;
+        }
+    }
+    qsort(candidates, count, sizeof(*candidates), compare_distances);
+    for (uint32_t i = 0; i < count; i++) {
+        record = &index.signatures[candidates[i].record];
+        //The hash only picks candidates, the full compare decides whether they are near
+        if ((mismatches = compare_candidate(image_name, index.names + record->name_offset, options->tolerance)) < 0 ||
+            mismatches * 100 > (long long)options->max_differing * record->width * record->height)
+            continue;
+        printf("near %s %u %lld\n", index.names + record->name_offset, candidates[i].distance, mismatches);
+        found = 1;
+    }
+    fflush(stdout);
+    free(candidates);
+    free(exact);
+    free(index.data);
+    return found ? 0 : 1;
+}
@@ -0,0 +1,32 @@
+#ifndef IMAGE_INDEX_H
+#define IMAGE_INDEX_H
+
+#include <stdint.h>
+#include "compare.h"
+
+#define INDEX_MAGIC     "BMPX"
+#define INDEX_VERSION     1
+
+//What the index keeps of an image. Records are stored sorted by digest, in the byte order of the host,
+//followed by the NUL-terminated names they point into.
+typedef struct {
+    uint64_t digest;        //Of the colors of the pixels row by row from the top, palettes resolved
+    uint64_t perceptual_hash;       //One bit per cell of an 8x8 grid: the mean luma of the cell is above the image mean
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t name_offset;
+} image_signature;
+
+//--index-build: signs every .bmp file under directory (recursively) and writes the index to index_name.
+//Files that are not supported images are skipped. Returns 0, or -1 after printing what is wrong.
+int build_image_index (const char *directory, const char *index_name);
+
+//--index-query: prints on stdout the images of the index that equal image_name ("exact <name>"), looked up by digest,
+//and those whose perceptual hash is within options->max_distance bits ("near <name> <distance> <differing pixels>").
+//Only images of the same size and depth are candidates, and each one is checked with a full pixel compare:
+//a near one must not differ (beyond options->tolerance) in more than options->max_differing percent of its pixels.
+//Returns 0 when a match was found, 1 when none was and -1.
+int query_image_index (const char *index_name, const char *image_name, const compare_options *options);
+
+#endif
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "paired_reader.h"
+#include "perf_counters.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+
+static unsigned int band_rows (const paired_reader *reader, unsigned int band)
+{
+    unsigned int first = band * reader->rows_per_band;
+    return reader->rows - first < reader->rows_per_band ? reader->rows - first : reader->rows_per_band;
+}
+
+
+static long long band_offset (const paired_reader *reader, const paired_stream *stream, unsigned int band)
+{
+    long long first_row = (long long)band * reader->rows_per_band;
+    if (stream->reversed)
+        first_row = reader->rows - first_row - band_rows(reader, band);
+    return stream->offset + first_row * (long long)reader->bytes_in_row;
+}
+
+
+//Kernel readahead only follows forward reads, a reversed stream announces its bands itself
+static void advise_band (const paired_reader *reader, const paired_stream *stream, unsigned int band)
+{
+    if (stream->reversed && band < reader->bands)
+        posix_fadvise(stream->fd, band_offset(reader, stream, band), band_rows(reader, band) * reader->bytes_in_row,
+                      POSIX_FADV_WILLNEED);
+}
+
+
+static int read_band (paired_stream *stream, unsigned int band)
+{
+    paired_reader *reader = stream->reader;
+    size_t size = band_rows(reader, band) * reader->bytes_in_row, bytes = size;
+    long long offset = band_offset(reader, stream, band);
+    uint8_t *out = stream->slots[band % PAIRED_READER_SLOTS];
+    ssize_t done;
+    perf_scope scope;
+    perf_phase_begin(&scope);
+    while (size > 0) {
+        done = pread(stream->fd, out, size, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0) {
+            error(done == 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+            return -1;
+        }
+        out += done;
+        offset += done;
+        size -= done;
+    }
+    perf_phase_end(&scope, PERF_PIXEL_READ, bytes);
+    //The slot is refilled with the band after the ones in flight, the kernel can fetch it meanwhile
+    advise_band(reader, stream, band + PAIRED_READER_SLOTS);
+    return 0;
+}
+
+
+static void *read_stream (void *argument)
+{
+    paired_stream *stream = argument;
+    paired_reader *reader = stream->reader;
+    int result, stop;
+    for (unsigned int band = 0; band < reader->bands; band++) {
+        pthread_mutex_lock(&reader->lock);
+        while (!reader->stop && band >= reader->consumed + PAIRED_READER_SLOTS)
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop)
+            break;
+        result = read_band(stream, band);
+        pthread_mutex_lock(&reader->lock);
+        if (result != 0)
+            stream->failed = 1;
+        else
+            stream->produced = band + 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (result != 0)
+            break;
+    }
+    perf_counters_release_thread();
+    return NULL;
+}
+
+
+int paired_reader_start (paired_reader *reader, int first_fd, long long first_offset, int second_fd,
+                         long long second_offset, int second_reversed, size_t bytes_in_row, unsigned int rows,
+                         unsigned int rows_per_band)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->bytes_in_row = bytes_in_row;
+    reader->rows = rows;
+    reader->rows_per_band = rows_per_band;
+    reader->bands = rows ? (rows + rows_per_band - 1) / rows_per_band : 0;
+    reader->streams[0].fd = first_fd;
+    reader->streams[0].offset = first_offset;
+    reader->streams[1].fd = second_fd;
+    reader->streams[1].offset = second_offset;
+    reader->streams[1].reversed = second_reversed;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    for (int i = 0; i < 2; i++) {
+        paired_stream *stream = &reader->streams[i];
+        stream->reader = reader;
+        for (int k = 0; k < PAIRED_READER_SLOTS; k++)
+            if ((stream->slots[k] = malloc((size_t)rows_per_band * bytes_in_row + 1)) == NULL) {
+                error("Memory allocation error.");
+                paired_reader_stop(reader);
+                return -1;
+            }
+        //A reversed file is still read forwards inside every band, but the bands go backwards
+        if (!stream->reversed)
+            posix_fadvise(stream->fd, stream->offset, (off_t)rows * bytes_in_row, POSIX_FADV_SEQUENTIAL);
+        for (unsigned int band = 0; band < PAIRED_READER_SLOTS; band++)
+            advise_band(reader, stream, band);
+    }
+    //A thread blocked in pread takes no processor, so the reads overlap even on a single one
+    for (int i = 0; i < 2; i++)
+        reader->streams[i].threaded = pthread_create(&reader->streams[i].thread, NULL, read_stream,
+                                                     &reader->streams[i]) == 0;
+    return 0;
+}
+
+
+int paired_reader_next (paired_reader *reader, uint8_t **first, uint8_t **second, unsigned int *count)
+{
+    unsigned int band = reader->consumed;
+    int failed;
+    for (int i = 0; i < 2; i++) {
+        paired_stream *stream = &reader->streams[i];
+        if (!stream->threaded) {
+            if (stream->produced <= band && read_band(stream, band))
+                return -1;
+            stream->produced = band + 1;
+            continue;
+        }
+        pthread_mutex_lock(&reader->lock);
+        while (stream->produced <= band && !stream->failed)
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        failed = stream->produced <= band;
+        pthread_mutex_unlock(&reader->lock);
+        if (failed)
+            return -1;
+    }
+    *first = reader->streams[0].slots[band % PAIRED_READER_SLOTS];
+    *second = reader->streams[1].slots[band % PAIRED_READER_SLOTS];
+    *count = band_rows(reader, band);
+    return 0;
+}
+
+
+void paired_reader_release (paired_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->consumed++;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+
+void paired_reader_stop (paired_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    for (int i = 0; i < 2; i++) {
+        if (reader->streams[i].threaded)
+            pthread_join(reader->streams[i].thread, NULL);
+        for (int k = 0; k < PAIRED_READER_SLOTS; k++)
+            free(reader->streams[i].slots[k]);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+}
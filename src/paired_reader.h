@@ -0,0 +1,50 @@
+#ifndef PAIRED_READER_H
+#define PAIRED_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define PAIRED_READER_SLOTS     4       //Bands of each file read ahead of the consumer at most
+
+//Row bands of one of the two files
+typedef struct {
+    int fd;
+    long long offset;       //Of the pixel array
+    int reversed;       //Band k holds the k-th rows from the end of the file, rows stay in file order inside it
+    int threaded;       //Read by a thread of its own, or on demand by the consumer when none could be started
+    pthread_t thread;
+    uint8_t *slots[PAIRED_READER_SLOTS];
+    unsigned int produced;      //Bands read so far
+    int failed;
+    struct paired_reader *reader;
+} paired_stream;
+
+//Reads the pixel arrays of two images of the same layout at once, one thread per file, so the time spent
+//waiting for the slower file hides the other one. Forward pixel arrays are
+//announced to the kernel as sequential; a reversed one asks for the bands it will read next while the consumer works.
+typedef struct paired_reader {
+    paired_stream streams[2];
+    size_t bytes_in_row;
+    unsigned int rows;
+    unsigned int rows_per_band;
+    unsigned int bands;
+    unsigned int consumed;      //Bands handed back by the consumer
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} paired_reader;
+
+//Starts reading rows of bytes_in_row bytes from the pixel arrays at the offsets. The second file is read
+//from its end when second_reversed is set. Returns 0, or -1 after printing what is wrong.
+int paired_reader_start (paired_reader *reader, int first_fd, long long first_offset, int second_fd,
+                         long long second_offset, int second_reversed, size_t bytes_in_row, unsigned int rows,
+                         unsigned int rows_per_band);
+//Waits for the next band of both files: count rows at first and second. Returns 0, or -1 when a read failed.
+//The band stays valid until paired_reader_release.
+int paired_reader_next (paired_reader *reader, uint8_t **first, uint8_t **second, unsigned int *count);
+void paired_reader_release (paired_reader *reader);
+//Stops the threads and frees the bands
+void paired_reader_stop (paired_reader *reader);
+
+#endif
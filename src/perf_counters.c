@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "perf_counters.h"
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define PERF_EVENTS     5
+#define MEGABYTE     (1024.0 * 1024.0)
+
+enum { CYCLES, INSTRUCTIONS, LLC_MISSES, DTLB_MISSES, BRANCH_MISSES };
+
+static const char *phase_names[PERF_PHASES] = { "header", "palette", "pixel read", "transform", "write" };
+
+typedef struct {
+    unsigned long long counts[PERF_PHASES][PERF_EVENTS];
+    unsigned long long bytes[PERF_PHASES];
+    unsigned long long calls[PERF_PHASES];
+} perf_totals;
+
+static int enabled;
+static int available[PERF_EVENTS];      //Events the host could open, every thread opens the same ones
+static int exclude_kernel;
+static perf_totals totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+int perf_counters_enabled (void)
+{
+    return enabled;
+}
+
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+static __thread int group_fd = -1;      //-1 - not opened yet, -2 - could not be opened
+static __thread int member_fds[PERF_EVENTS];
+
+
+static void describe_event (int event, struct perf_event_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_HARDWARE;
+    switch (event) {
+        case CYCLES:
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case INSTRUCTIONS:
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case LLC_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                           PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+            break;
+        case DTLB_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                           PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+            break;
+        default:
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+    }
+    attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr->exclude_kernel = exclude_kernel;
+    attr->exclude_hv = 1;
+}
+
+
+static int open_event (int event, int leader)
+{
+    struct perf_event_attr attr;
+    describe_event(event, &attr);
+    //The events of this thread on any CPU
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+}
+
+
+//Opens the group of the calling thread. The leader counts cycles, the other events join it,
+//so all of them are scheduled on the PMU together and their ratios are meaningful.
+static int open_group (void)
+{
+    if ((group_fd = open_event(CYCLES, -1)) < 0) {
+        group_fd = -2;
+        return -1;
+    }
+    for (int i = INSTRUCTIONS; i < PERF_EVENTS; i++)
+        member_fds[i] = available[i] ? open_event(i, group_fd) : -1;
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+
+int perf_counters_enable (void)
+{
+    int fd;
+    if (enabled)
+        return 0;
+    if ((fd = open_event(CYCLES, -1)) < 0 && (errno == EACCES || errno == EPERM)) {
+        //Unprivileged users may still count their own code
+        exclude_kernel = 1;
+        fd = open_event(CYCLES, -1);
+    }
+    if (fd < 0) {
+        error("Hardware performance counters are not available: %s\n", strerror(errno));
+        return -1;
+    }
+    available[CYCLES] = 1;
+    for (int i = INSTRUCTIONS; i < PERF_EVENTS; i++) {
+        member_fds[i] = open_event(i, fd);
+        available[i] = member_fds[i] >= 0;
+        if (available[i])
+            close(member_fds[i]);
+    }
+    close(fd);
+    memset(&totals, 0, sizeof(totals));
+    enabled = 1;
+    return 0;
+}
+
+
+//Reads the group into values: time enabled, time running and then one value per event (0 when not available)
+static int read_group (unsigned long long *values)
+{
+    unsigned long long data[3 + PERF_EVENTS];
+    int k = 0;
+    if (read(group_fd, data, sizeof(data)) < (ssize_t)(3 * sizeof(data[0])))
+        return -1;
+    values[0] = data[1];
+    values[1] = data[2];
+    for (int i = 0; i < PERF_EVENTS; i++)
+        values[2 + i] = (i == CYCLES || member_fds[i] >= 0) && k < (int)data[0] ? data[3 + k++] : 0;
+    return 0;
+}
+
+
+void perf_phase_begin (perf_scope *scope)
+{
+    scope->valid = 0;
+    if (!enabled || group_fd == -2 || (group_fd == -1 && open_group()))
+        return;
+    scope->valid = read_group(scope->values) == 0;
+}
+
+
+void perf_phase_end (perf_scope *scope, perf_phase phase, unsigned long long bytes)
+{
+    unsigned long long values[2 + PERF_EVENTS], running, time_enabled, delta;
+    if (!scope->valid || read_group(values))
+        return;
+    time_enabled = values[0] - scope->values[0];
+    running = values[1] - scope->values[1];
+    pthread_mutex_lock(&totals_lock);
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        delta = values[2 + i] - scope->values[2 + i];
+        //The PMU may have been shared with other groups for part of the phase, so the count is scaled
+        if (running != 0 && running < time_enabled)
+            delta = (unsigned long long)((double)delta * time_enabled / running);
+        totals.counts[phase][i] += delta;
+    }
+    totals.bytes[phase] += bytes;
+    totals.calls[phase]++;
+    pthread_mutex_unlock(&totals_lock);
+}
+
+
+void perf_counters_release_thread (void)
+{
+    if (group_fd < 0)
+        return;
+    for (int i = INSTRUCTIONS; i < PERF_EVENTS; i++)
+        if (member_fds[i] >= 0)
+            close(member_fds[i]);
+    close(group_fd);
+    group_fd = -1;
+}
+
+#else
+
+int perf_counters_enable (void)
+{
+    error("Hardware performance counters are not supported on this system.\n");
+    return -1;
+}
+
+
+void perf_phase_begin (perf_scope *scope)
+{
+    scope->valid = 0;
+}
+
+
+void perf_phase_end (perf_scope *scope, perf_phase phase, unsigned long long bytes)
+{
+}
+
+
+void perf_counters_release_thread (void)
+{
+}
+
+#endif
+
+
+static void print_per_megabyte (int event, unsigned long long count, unsigned long long bytes)
+{
+    if (!available[event])
+        error(" %14s", "n/a");
+    else if (bytes == 0)
+        error(" %14s", "-");
+    else
+        error(" %14.1f", count / (bytes / MEGABYTE));
+}
+
+
+void perf_counters_report (void)
+{
+    unsigned long long *counts;
+    if (!enabled)
+        return;
+    perf_counters_release_thread();
+    pthread_mutex_lock(&totals_lock);
+    error("Performance counters (%s):\n", exclude_kernel ? "user space only" : "user and kernel space");
+    error("%-10s %10s %14s %14s %6s %14s %14s %14s\n", "phase", "MB", "cycles", "instructions", "IPC",
+          "LLC-miss/MB", "dTLB-miss/MB", "br-miss/MB");
+    for (int phase = 0; phase < PERF_PHASES; phase++) {
+        if (totals.calls[phase] == 0)
+            continue;
+        counts = totals.counts[phase];
+        error("%-10s %10.3f %14llu", phase_names[phase], totals.bytes[phase] / MEGABYTE, counts[CYCLES]);
+        if (available[INSTRUCTIONS])
+            error(" %14llu %6.2f", counts[INSTRUCTIONS],
+                  counts[CYCLES] ? (double)counts[INSTRUCTIONS] / counts[CYCLES] : 0.0);
+        else
+            error(" %14s %6s", "n/a", "n/a");
+        print_per_megabyte(LLC_MISSES, counts[LLC_MISSES], totals.bytes[phase]);
+        print_per_megabyte(DTLB_MISSES, counts[DTLB_MISSES], totals.bytes[phase]);
+        print_per_megabyte(BRANCH_MISSES, counts[BRANCH_MISSES], totals.bytes[phase]);
+        error("\n");
+    }
+    pthread_mutex_unlock(&totals_lock);
+}
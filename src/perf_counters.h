@@ -0,0 +1,38 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+//Hardware performance counters (--perf-counters) read around the phases of a conversion or a comparison.
+//Every thread that measures a phase gets its own perf_event_open group of cycles, instructions,
+//LLC misses, dTLB misses and branch misses, and the differences are summed per phase over all threads.
+//While the counters are off the phase calls cost one branch.
+
+typedef enum {
+    PERF_HEADER,
+    PERF_PALETTE,
+    PERF_PIXEL_READ,
+    PERF_TRANSFORM,     //The lookup table of the converter or the row compare of the comparer
+    PERF_WRITE,
+    PERF_PHASES
+} perf_phase;
+
+//The state of a phase in progress, kept by the caller
+typedef struct {
+    int valid;
+    unsigned long long values[8];
+} perf_scope;
+
+//Turns the counters on once the host is found to support them. Returns -1 after printing why they are not available.
+int perf_counters_enable (void);
+int perf_counters_enabled (void);
+
+void perf_phase_begin (perf_scope *scope);
+//Adds what was counted since perf_phase_begin and the bytes the phase processed to the totals of phase
+void perf_phase_end (perf_scope *scope, perf_phase phase, unsigned long long bytes);
+
+//Closes the counters of the calling thread. Threads that measured phases call it before they exit.
+void perf_counters_release_thread (void);
+
+//Prints IPC and misses per MB of every measured phase to stderr and closes the counters of the calling thread.
+void perf_counters_report (void);
+
+#endif
@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "perf_counters.h"
+#include "pipeline.h"
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define BANDS_IN_FLIGHT     4
+#define BAND_BYTES     (1 << 20)
+#define DIRECT_ALIGNMENT     4096
+#define DIRECT_BLOCK_BYTES     (1 << 20)
+
+//Layout of the bands shared by both engines. Band i always lives in buffer i % BANDS_IN_FLIGHT.
+typedef struct {
+    const band_pipeline *pipeline;
+    uint8_t *buffers;
+    unsigned int rows_per_band;
+    unsigned int bands;
+} band_layout;
+
+
+static unsigned int band_rows (const band_layout *layout, unsigned int band)
+{
+    unsigned int first_row = band * layout->rows_per_band;
+    if (layout->pipeline->rows - first_row < layout->rows_per_band)
+        return layout->pipeline->rows - first_row;
+    return layout->rows_per_band;
+}
+
+
+static uint8_t *band_buffer (const band_layout *layout, unsigned int band)
+{
+    return layout->buffers + (size_t)(band % BANDS_IN_FLIGHT) * layout->rows_per_band * layout->pipeline->row_size;
+}
+
+
+static long long band_offset (const band_layout *layout, unsigned int band)
+{
+    return (long long)band * layout->rows_per_band * layout->pipeline->row_size;
+}
+
+
+int pread_full (int fd, uint8_t *buffer, size_t size, long long offset)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = pread(fd, buffer, size, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return -1;
+        if (done == 0)
+            return 1;
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+int pwrite_full (int fd, const uint8_t *buffer, size_t size, long long offset)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = pwrite(fd, buffer, size, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+static void print_read_error (int result)
+{
+    if (result > 0)
+        error("Pixel array read error. End of file.");
+    else
+        error("Pixel array read error.");
+}
+
+
+//Thread-based engine: a reader thread prefetches bands, a writer thread flushes them,
+//the calling thread transforms. Counters say how many bands have passed each stage.
+typedef struct {
+    band_layout layout;
+    unsigned int read_bands;
+    unsigned int transformed_bands;
+    unsigned int written_bands;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} band_queue;
+
+
+static void *band_reader (void *argument)
+{
+    band_queue *queue = argument;
+    const band_pipeline *pipeline = queue->layout.pipeline;
+    perf_scope scope;
+    int result, failed;
+    for (unsigned int i = 0; i < queue->layout.bands; i++) {
+        pthread_mutex_lock(&queue->lock);
+        while (i - queue->written_bands >= BANDS_IN_FLIGHT && !queue->failed)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        failed = queue->failed;
+        pthread_mutex_unlock(&queue->lock);
+        if (failed)
+            break;
+        perf_phase_begin(&scope);
+        result = pread_full(pipeline->input_fd, band_buffer(&queue->layout, i),
+                            (size_t)band_rows(&queue->layout, i) * pipeline->row_size,
+                            pipeline->input_offset + band_offset(&queue->layout, i));
+        perf_phase_end(&scope, PERF_PIXEL_READ, (size_t)band_rows(&queue->layout, i) * pipeline->row_size);
+        pthread_mutex_lock(&queue->lock);
+        if (result != 0) {
+            print_read_error(result);
+            queue->failed = 1;
+        }
+        else
+            queue->read_bands = i + 1;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+        if (result != 0)
+            break;
+    }
+    perf_counters_release_thread();
+    return NULL;
+}
+
+
+//Gathers the bands, which are written in file order, into aligned blocks for O_DIRECT.
+//The block that holds the start of the pixel array is completed with what is already in the file.
+typedef struct {
+    int fd;
+    int direct;
+    uint8_t *block;
+    size_t used;
+    long long offset;       //Of the first byte of block in the file
+} direct_writer;
+
+
+static void direct_writer_open (direct_writer *writer, int fd, long long offset, int direct)
+{
+    int flags;
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    if (!direct)
+        return;
+    writer->offset = offset & ~(long long)(DIRECT_ALIGNMENT - 1);
+    writer->used = offset - writer->offset;
+    if (posix_memalign((void **)&writer->block, DIRECT_ALIGNMENT, DIRECT_BLOCK_BYTES)) {
+        writer->block = NULL;
+        return;
+    }
+    if (writer->used != 0 && pread_full(fd, writer->block, writer->used, writer->offset) != 0)
+        return;
+    //File systems without O_DIRECT refuse the flag, those get plain writes
+    flags = fcntl(fd, F_GETFL);
+    writer->direct = flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+}
+
+
+static int direct_write (direct_writer *writer, const uint8_t *data, size_t size, long long offset)
+{
+    size_t part;
+    if (!writer->direct)
+        return pwrite_full(writer->fd, data, size, offset);
+    while (size > 0) {
+        part = DIRECT_BLOCK_BYTES - writer->used < size ? DIRECT_BLOCK_BYTES - writer->used : size;
+        memcpy(writer->block + writer->used, data, part);
+        writer->used += part;
+        data += part;
+        size -= part;
+        if (writer->used == DIRECT_BLOCK_BYTES) {
+            if (pwrite_full(writer->fd, writer->block, DIRECT_BLOCK_BYTES, writer->offset))
+                return -1;
+            writer->offset += DIRECT_BLOCK_BYTES;
+            writer->used = 0;
+        }
+    }
+    return 0;
+}
+
+
+//Writes the aligned part of the last block directly and the tail, which O_DIRECT can not write, through the cache
+static int direct_writer_close (direct_writer *writer, int failed)
+{
+    size_t aligned = writer->used & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    int flags;
+    if (writer->direct) {
+        if (!failed && aligned != 0)
+            failed = pwrite_full(writer->fd, writer->block, aligned, writer->offset) != 0;
+        flags = fcntl(writer->fd, F_GETFL);
+        if (flags == -1 || fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT))
+            failed = 1;
+        if (!failed && writer->used > aligned)
+            failed = pwrite_full(writer->fd, writer->block + aligned, writer->used - aligned, writer->offset + aligned) != 0;
+    }
+    free(writer->block);
+    writer->block = NULL;
+    writer->direct = 0;
+    return failed ? -1 : 0;
+}
+
+
+static void *band_writer (void *argument)
+{
+    band_queue *queue = argument;
+    const band_pipeline *pipeline = queue->layout.pipeline;
+    direct_writer writer;
+    perf_scope scope;
+    int result = 0, failed;
+    direct_writer_open(&writer, pipeline->output_fd, pipeline->output_offset, pipeline->direct_output);
+    for (unsigned int i = 0; i < queue->layout.bands; i++) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->transformed_bands <= i && !queue->failed)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        failed = queue->failed;
+        pthread_mutex_unlock(&queue->lock);
+        if (failed)
+            break;
+        perf_phase_begin(&scope);
+        result = direct_write(&writer, band_buffer(&queue->layout, i),
+                              (size_t)band_rows(&queue->layout, i) * pipeline->row_size,
+                              pipeline->output_offset + band_offset(&queue->layout, i));
+        if (result == 0 && i + 1 == queue->layout.bands)
+            result = direct_writer_close(&writer, 0);
+        perf_phase_end(&scope, PERF_WRITE, (size_t)band_rows(&queue->layout, i) * pipeline->row_size);
+        pthread_mutex_lock(&queue->lock);
+        if (result != 0) {
+            error("Data writing error");
+            queue->failed = 1;
+        }
+        else
+            queue->written_bands = i + 1;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+        if (result != 0)
+            break;
+    }
+    //The last band closes the writer itself, so its buffered blocks count before the band is reported written
+    if (queue->written_bands != queue->layout.bands)
+        direct_writer_close(&writer, 1);
+    perf_counters_release_thread();
+    return NULL;
+}
+
+
+static int run_threaded_pipeline (const band_layout *layout)
+{
+    band_queue queue;
+    pthread_t reader, writer;
+    const band_pipeline *pipeline = layout->pipeline;
+    perf_scope scope;
+    int failed;
+    memset(&queue, 0, sizeof(queue));
+    queue.layout = *layout;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    if (pthread_create(&reader, NULL, band_reader, &queue)) {
+        error("Thread creation error.");
+        return -1;
+    }
+    if (pthread_create(&writer, NULL, band_writer, &queue)) {
+        error("Thread creation error.");
+        pthread_mutex_lock(&queue.lock);
+        queue.failed = 1;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+        pthread_join(reader, NULL);
+        return -1;
+    }
+    for (unsigned int i = 0; i < layout->bands; i++) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.read_bands <= i && !queue.failed)
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        failed = queue.failed;
+        pthread_mutex_unlock(&queue.lock);
+        if (failed)
+            break;
+        if (pipeline->transform != NULL) {
+            perf_phase_begin(&scope);
+            pipeline->transform(band_buffer(layout, i), band_rows(layout, i), pipeline->context);
+            perf_phase_end(&scope, PERF_TRANSFORM, (size_t)band_rows(layout, i) * pipeline->row_size);
+        }
+        pthread_mutex_lock(&queue.lock);
+        queue.transformed_bands = i + 1;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+    return queue.failed ? -1 : 0;
+}
+
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+enum band_state { BAND_FREE, BAND_READING, BAND_READY, BAND_WRITING };
+
+//Minimal io_uring ring set up through raw system calls, so no liburing is needed.
+typedef struct {
+    int fd;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned int to_submit;
+} uring;
+
+typedef struct {
+    enum band_state state;
+    unsigned int band;
+    size_t done;
+    size_t size;
+    struct iovec iov;
+} uring_slot;
+
+
+static int uring_setup (uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return -1;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+
+static void uring_teardown (uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+
+//Queues the rest of the slot's read or write. It is handed to the kernel by the next uring_enter.
+static void uring_queue (uring *ring, const band_layout *layout, unsigned int slot_index, uring_slot *slot)
+{
+    const band_pipeline *pipeline = layout->pipeline;
+    unsigned int tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    slot->iov.iov_base = band_buffer(layout, slot->band) + slot->done;
+    slot->iov.iov_len = slot->size - slot->done;
+    if (slot->state == BAND_READING) {
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = pipeline->input_fd;
+        sqe->off = pipeline->input_offset + band_offset(layout, slot->band) + slot->done;
+    }
+    else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = pipeline->output_fd;
+        sqe->off = pipeline->output_offset + band_offset(layout, slot->band) + slot->done;
+    }
+    sqe->addr = (unsigned long)&slot->iov;
+    sqe->len = 1;
+    sqe->user_data = slot_index;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+
+static int uring_enter (uring *ring, unsigned int wait_for)
+{
+    int result;
+    do
+        result = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_for,
+                              wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (result < 0 && errno == EINTR);
+    if (result < 0)
+        return -1;
+    ring->to_submit -= result;
+    return 0;
+}
+
+
+static int run_uring_pipeline (uring *ring, const band_layout *layout)
+{
+    uring_slot slots[BANDS_IN_FLIGHT];
+    const band_pipeline *pipeline = layout->pipeline;
+    unsigned int next_read = 0, next_transform = 0, written = 0, in_flight = 0, head, slot_index;
+    int failed = 0;
+    struct io_uring_cqe *cqe;
+    uring_slot *slot;
+    memset(slots, 0, sizeof(slots));
+    while (written < layout->bands && !failed) {
+        while (next_read < layout->bands && slots[next_read % BANDS_IN_FLIGHT].state == BAND_FREE) {
+            slot = &slots[next_read % BANDS_IN_FLIGHT];
+            slot->state = BAND_READING;
+            slot->band = next_read;
+            slot->done = 0;
+            slot->size = (size_t)band_rows(layout, next_read) * pipeline->row_size;
+            uring_queue(ring, layout, next_read % BANDS_IN_FLIGHT, slot);
+            in_flight++;
+            next_read++;
+        }
+        slot = &slots[next_transform % BANDS_IN_FLIGHT];
+        if (next_transform < layout->bands && slot->state == BAND_READY) {
+            if (ring->to_submit && uring_enter(ring, 0)) {
+                error("io_uring submission error.");
+                failed = 1;
+                break;
+            }
+            if (pipeline->transform != NULL)
+                pipeline->transform(band_buffer(layout, next_transform), band_rows(layout, next_transform),
+                                    pipeline->context);
+            slot->state = BAND_WRITING;
+            slot->done = 0;
+            uring_queue(ring, layout, next_transform % BANDS_IN_FLIGHT, slot);
+            in_flight++;
+            next_transform++;
+            continue;
+        }
+        if (uring_enter(ring, 1)) {
+            error("io_uring submission error.");
+            failed = 1;
+            break;
+        }
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            slot_index = (unsigned int)cqe->user_data;
+            slot = &slots[slot_index];
+            in_flight--;
+            if (cqe->res <= 0) {
+                if (slot->state == BAND_READING)
+                    print_read_error(cqe->res == 0 ? 1 : -1);
+                else
+                    error("Data writing error");
+                failed = 1;
+            }
+            else {
+                slot->done += cqe->res;
+                if (slot->done < slot->size) {
+                    uring_queue(ring, layout, slot_index, slot);
+                    in_flight++;
+                }
+                else if (slot->state == BAND_READING)
+                    slot->state = BAND_READY;
+                else {
+                    slot->state = BAND_FREE;
+                    written++;
+                }
+            }
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    //The buffers must outlive every request the kernel still holds
+    while (in_flight > 0) {
+        if (uring_enter(ring, 1))
+            return -2;
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            in_flight--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return failed ? -1 : 0;
+}
+
+#endif
+
+
+//Kept per thread, so repeated conversions (the conversion service) reuse the buffers and the ring
+static __thread uint8_t *cached_buffers;
+static __thread size_t cached_buffers_size;
+#ifdef HAVE_LINUX_IO_URING_H
+static __thread uring cached_ring;
+static __thread int cached_ring_state;     //0 - not set up yet, 1 - ready, -1 - io_uring is not available
+#endif
+
+
+static uint8_t *get_band_buffers (size_t size)
+{
+    uint8_t *buffers;
+    if (size <= cached_buffers_size)
+        return cached_buffers;
+    if ((buffers = realloc(cached_buffers, size)) == NULL)
+        return NULL;
+    cached_buffers = buffers;
+    cached_buffers_size = size;
+    return buffers;
+}
+
+
+int run_band_pipeline (const band_pipeline *pipeline)
+{
+    band_layout layout;
+    int result;
+    if (pipeline->rows == 0 || pipeline->row_size == 0)
+        return 0;
+    layout.pipeline = pipeline;
+    layout.rows_per_band = BAND_BYTES / pipeline->row_size;
+    if (layout.rows_per_band == 0)
+        layout.rows_per_band = 1;
+    if (layout.rows_per_band > pipeline->rows)
+        layout.rows_per_band = pipeline->rows;
+    layout.bands = (pipeline->rows + layout.rows_per_band - 1) / layout.rows_per_band;
+    if ((layout.buffers = get_band_buffers((size_t)BANDS_IN_FLIGHT * layout.rows_per_band * pipeline->row_size)) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+    //The kernel reads and writes io_uring requests in its own workers, where the counters of the
+    //calling thread can not see them, so phases are measured with the reader and writer threads
+    if (perf_counters_enabled())
+        return run_threaded_pipeline(&layout);
+    //Aligned O_DIRECT blocks are gathered by the writer thread
+    if (pipeline->direct_output)
+        return run_threaded_pipeline(&layout);
+    if (cached_ring_state == 0)
+        cached_ring_state = uring_setup(&cached_ring, 2 * BANDS_IN_FLIGHT) == 0 ? 1 : -1;
+    if (cached_ring_state == 1) {
+        result = run_uring_pipeline(&cached_ring, &layout);
+        if (result == -2) {
+            //Requests may still be queued in the ring, so it can not be reused
+            uring_teardown(&cached_ring);
+            cached_ring_state = 0;
+            result = -1;
+        }
+        return result;
+    }
+#endif
+    return run_threaded_pipeline(&layout);
+}
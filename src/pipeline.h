@@ -0,0 +1,34 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Called for every band of rows after it has been read and before it is written. May be NULL for a plain copy.
+typedef void (*band_transform_t) (uint8_t *band, unsigned int rows, void *context);
+
+//Describes one pass over a pixel array: rows are read from input_fd starting at input_offset,
+//transformed band by band and written to output_fd starting at output_offset.
+typedef struct {
+    int input_fd;
+    int output_fd;
+    long long input_offset;
+    long long output_offset;
+    unsigned int row_size;
+    unsigned int rows;
+    band_transform_t transform;
+    void *context;
+    int direct_output;      //Write with O_DIRECT in aligned blocks, bypassing the page cache, where the file system allows it
+} band_pipeline;
+
+//pread and pwrite that go on after short transfers. pread_full returns 0 on success,
+//1 on an unexpected end of file and -1 on a read error, pwrite_full returns 0 or -1.
+int pread_full (int fd, uint8_t *buffer, size_t size, long long offset);
+int pwrite_full (int fd, const uint8_t *buffer, size_t size, long long offset);
+
+//Keeps several row bands in flight, so the read of band N+1 and the write of band N-1 overlap
+//with the transform of band N. Uses io_uring when the kernel allows it and reader/writer threads otherwise.
+//Returns 0 on success and -1 on an I/O error (the message is already printed).
+int run_band_pipeline (const band_pipeline *pipeline);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_header.h"
+#include "preview.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define PIXELS_PER_METER     2835    //72 DPI
+
+
+int preview_open (preview_writer *preview, const char *file_name, const uint32_t *header, unsigned int scale)
+{
+    uint32_t preview_header[HEADER_CELLS];
+    uint16_t header_field = 0x4d42;
+    unsigned int rows = abs((signed)header[HEIGHT_A]);
+    memset(preview, 0, sizeof(*preview));
+    preview->scale = scale;
+    preview->width = header[WIDTH_A];
+    preview->rows_left = rows;
+    preview->preview_width = (header[WIDTH_A] + scale - 1) / scale;
+    preview->preview_rows = (rows + scale - 1) / scale;
+    preview->bytes_in_row = (size_t)preview->preview_width * 3 + preview->preview_width % 4;
+    if ((preview->sums = calloc((size_t)preview->preview_width * 3 + 1, sizeof(uint32_t))) == NULL ||
+        (preview->row = calloc(preview->bytes_in_row + 1, sizeof(uint8_t))) == NULL) {
+        error("Memory allocation error.");
+        free(preview->sums);
+        return -1;
+    }
+    if (atomic_output_open(&preview->output, file_name,
+                           HEADER_SIZE + (unsigned long long)preview->bytes_in_row * preview->preview_rows, 0)) {
+        free(preview->sums);
+        free(preview->row);
+        return -1;
+    }
+    preview->file = preview->output.file;
+    memset(preview_header, 0, sizeof(preview_header));
+    preview_header[FILE_SIZE_A] = HEADER_SIZE + preview->bytes_in_row * preview->preview_rows;
+    preview_header[PIXEL_ARRAY_ADDRESS_A] = HEADER_SIZE;
+    preview_header[DIB_HEADER_SIZE_A] = 40;
+    preview_header[WIDTH_A] = preview->preview_width;
+    //The preview keeps the row order of the source, so its rows are written in the order they are built
+    preview_header[HEIGHT_A] = (signed)header[HEIGHT_A] < 0 ? -(int32_t)preview->preview_rows : (int32_t)preview->preview_rows;
+    preview_header[FORMAT_A] = 24 << 16 | 1;
+    preview_header[IMAGE_SIZE_A] = preview->bytes_in_row * preview->preview_rows;
+    preview_header[9] = PIXELS_PER_METER;
+    preview_header[10] = PIXELS_PER_METER;
+    if (fwrite(&header_field, sizeof(uint16_t), 1, preview->file) != 1 ||
+        fwrite(preview_header, sizeof(uint8_t), HEADER_SIZE - 2, preview->file) != HEADER_SIZE - 2) {
+        error("Data writing error");
+        preview->failed = 1;
+    }
+    return 0;
+}
+
+
+//Writes the averages of the finished box row and starts the next one
+static void finish_preview_row (preview_writer *preview)
+{
+    unsigned int box_width, count;
+    for (unsigned int x = 0; x < preview->preview_width; x++) {
+        box_width = preview->width - x * preview->scale < preview->scale ? preview->width - x * preview->scale : preview->scale;
+        count = box_width * preview->rows_in_box;
+        for (int c = 0; c < 3; c++)
+            preview->row[x * 3 + c] = (preview->sums[x * 3 + c] + count / 2) / count;
+    }
+    if (!preview->failed && fwrite(preview->row, sizeof(uint8_t), preview->bytes_in_row, preview->file) != preview->bytes_in_row) {
+        error("Data writing error");
+        preview->failed = 1;
+    }
+    memset(preview->sums, 0, sizeof(uint32_t) * preview->preview_width * 3);
+    preview->rows_in_box = 0;
+}
+
+
+static void finish_source_row (preview_writer *preview)
+{
+    preview->rows_in_box++;
+    preview->rows_left--;
+    if (preview->rows_in_box == preview->scale || preview->rows_left == 0)
+        finish_preview_row(preview);
+}
+
+
+void preview_add_24bit_rows (preview_writer *preview, const uint8_t *rows, unsigned int count, size_t bytes_in_row)
+{
+    unsigned int scale = preview->scale;
+    uint32_t *sums;
+    const uint8_t *pixel;
+    for (unsigned int j = 0; j < count && preview->rows_left > 0; j++, rows += bytes_in_row) {
+        pixel = rows;
+        sums = preview->sums;
+        for (unsigned int x = 0; x < preview->width; x += scale, sums += 3) {
+            for (unsigned int k = 0; k < scale && x + k < preview->width; k++, pixel += 3) {
+                sums[0] += pixel[0];
+                sums[1] += pixel[1];
+                sums[2] += pixel[2];
+            }
+        }
+        finish_source_row(preview);
+    }
+}
+
+
+void preview_add_8bit_rows (preview_writer *preview, const uint8_t *rows, unsigned int count, size_t bytes_in_row,
+                            const uint8_t *palette)
+{
+    unsigned int scale = preview->scale;
+    uint32_t *sums;
+    const uint8_t *index, *color;
+    for (unsigned int j = 0; j < count && preview->rows_left > 0; j++, rows += bytes_in_row) {
+        index = rows;
+        sums = preview->sums;
+        for (unsigned int x = 0; x < preview->width; x += scale, sums += 3) {
+            for (unsigned int k = 0; k < scale && x + k < preview->width; k++, index++) {
+                color = palette + *index * 4;
+                sums[0] += color[0];
+                sums[1] += color[1];
+                sums[2] += color[2];
+            }
+        }
+        finish_source_row(preview);
+    }
+}
+
+
+int preview_close (preview_writer *preview)
+{
+    free(preview->sums);
+    free(preview->row);
+    if (preview->failed) {
+        atomic_output_abort(&preview->output);
+        return -1;
+    }
+    return atomic_output_commit(&preview->output);
+}
+
+
+void preview_abort (preview_writer *preview)
+{
+    free(preview->sums);
+    free(preview->row);
+    atomic_output_abort(&preview->output);
+}
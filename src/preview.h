@@ -0,0 +1,40 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "atomic_output.h"
+
+//Downscaled 24-bit copy of an image built while the image itself is converted (--preview, --scale 1/N).
+//Every preview pixel is the box-filtered average of an N x N block of the source. Rows are fed in file
+//order, band by band, and every finished preview row is written at once, so the source is read only once.
+typedef struct {
+    atomic_output output;
+    FILE *file;
+    unsigned int scale;
+    unsigned int width;     //Of the source
+    unsigned int preview_width;
+    unsigned int preview_rows;
+    unsigned int rows_in_box;       //Source rows summed into the preview row that is being built
+    unsigned int rows_left;     //Source rows that have not been fed yet
+    uint32_t *sums;     //Per channel sums of the preview row that is being built, a 4096 x 4096 box still fits
+    uint8_t *row;
+    size_t bytes_in_row;
+    int failed;
+} preview_writer;
+
+//Creates file_name and writes the header of the preview of the image described by header.
+//Returns 0, or -1 after printing what is wrong.
+int preview_open (preview_writer *preview, const char *file_name, const uint32_t *header, unsigned int scale);
+
+//Feed rows of the converted pixel array. palette (4-byte entries, 256 of them) gives the colors of 8-bit images.
+void preview_add_24bit_rows (preview_writer *preview, const uint8_t *rows, unsigned int count, size_t bytes_in_row);
+void preview_add_8bit_rows (preview_writer *preview, const uint8_t *rows, unsigned int count, size_t bytes_in_row,
+                            const uint8_t *palette);
+
+//Moves the finished file into place. Returns 0, or -1 if any write failed (the message is already printed).
+int preview_close (preview_writer *preview);
+//Drops the file of a conversion that failed
+void preview_abort (preview_writer *preview);
+
+#endif
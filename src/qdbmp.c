@@ -31,11 +31,22 @@ struct _BMP
 	BMP_Header	Header;
 	UCHAR*		Palette;
 	UCHAR*		Data;
+	UINT		PaletteCapacity;	/* Bytes allocated for the palette and the pixels, */
+	UINT		DataCapacity;		/* may exceed what the header asks for */
 };
 
 
-/* Holds the last error code */
-static BMP_STATUS BMP_LAST_ERROR_CODE = BMP_OK;
+/* Holds the last error code of the calling thread, so threads that use the
+   non-reentrant API do not race on it */
+#if defined( _MSC_VER )
+	#define BMP_THREAD_LOCAL	__declspec( thread )
+#elif defined( __GNUC__ )
+	#define BMP_THREAD_LOCAL	__thread
+#else
+	#define BMP_THREAD_LOCAL	_Thread_local
+#endif
+
+static BMP_THREAD_LOCAL BMP_STATUS BMP_LAST_ERROR_CODE = BMP_OK;
 
 
 /* Error description strings */
@@ -82,25 +93,29 @@ int		WriteUSHORT	( USHORT x, FILE* f );
 	Creates a blank BMP image with the specified dimensions
 	and bit depth.
 **************************************************************/
-BMP* BMP_Create( UINT width, UINT height, USHORT depth )
+BMP_STATUS BMP_Create_r( UINT width, UINT height, USHORT depth, BMP** result )
 {
 	BMP*	bmp;
 	UINT	bits_per_row;
 	UINT	palettesize = 0;
-	
+
+	if ( result == NULL )
+	{
+		return BMP_INVALID_ARGUMENT;
+	}
+	*result = NULL;
+
 	if ( depth == 8 ) palettesize = BMP_PALETTE_SIZE_8bpp; 
 	if ( depth == 4 ) palettesize = BMP_PALETTE_SIZE_4bpp;
 
 	if ( height <= 0 || width <= 0 )
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
-		return NULL;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	if ( depth != 4 && depth != 8 && depth != 24 && depth != 32 )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
-		return NULL;
+		return BMP_FILE_NOT_SUPPORTED;
 	}
 
 
@@ -108,8 +123,7 @@ BMP* BMP_Create( UINT width, UINT height, USHORT depth )
 	bmp =(BMP*)calloc( 1, sizeof( BMP ) );
 	if ( bmp == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
-		return NULL;
+		return BMP_OUT_OF_MEMORY;
 	}
 
 
@@ -147,9 +161,8 @@ BMP* BMP_Create( UINT width, UINT height, USHORT depth )
 		bmp->Palette = (UCHAR*) calloc( palettesize, sizeof( UCHAR ) );
 		if ( bmp->Palette == NULL )
 		{
-			BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
 			free( bmp );
-			return NULL;
+			return BMP_OUT_OF_MEMORY;
 		}
 	}
 	else
@@ -162,16 +175,18 @@ BMP* BMP_Create( UINT width, UINT height, USHORT depth )
 	bmp->Data = (UCHAR*) calloc( bmp->Header.ImageDataSize, sizeof( UCHAR ) );
 	if ( bmp->Data == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
 		free( bmp->Palette );
 		free( bmp );
-		return NULL;
+		return BMP_OUT_OF_MEMORY;
 	}
 
+	bmp->PaletteCapacity = palettesize;
+	bmp->DataCapacity = bmp->Header.ImageDataSize;
 
-	BMP_LAST_ERROR_CODE = BMP_OK;
 
-	return bmp;
+	*result = bmp;
+
+	return BMP_OK;
 }
 
 
@@ -202,156 +217,203 @@ void BMP_Free( BMP* bmp )
 
 
 /**************************************************************
-	Reads the specified BMP image file.
+	Grows a buffer of the image to hold size bytes. The old
+	contents are not kept, so nothing is copied, and a buffer
+	that is large enough is left as it is.
 **************************************************************/
-BMP* BMP_ReadFile( const char* filename )
+static BMP_STATUS ReserveBuffer( UCHAR** buffer, UINT* capacity, UINT size )
 {
-	BMP*	bmp;
-	FILE*	f;
-	UINT	palettesize=0;
+	UCHAR*	grown;
 
-	if ( filename == NULL )
+	if ( size <= *capacity && ( *buffer != NULL || size == 0 ) )
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
-		return NULL;
+		return BMP_OK;
 	}
 
-
-	/* Allocate */
-	bmp = (BMP*)calloc( 1, sizeof( BMP ) );
-	if ( bmp == NULL )
+	grown = (UCHAR*) malloc( size > 0 ? size : 1 );
+	if ( grown == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
-		return NULL;
+		return BMP_OUT_OF_MEMORY;
 	}
 
+	free( *buffer );
+	*buffer = grown;
+	*capacity = size;
 
-	/* Open file */
-	f = fopen( filename, "rb" );
-	if ( f == NULL )
+	return BMP_OK;
+}
+
+
+/**************************************************************
+	Reads a BMP image from the current position of an open
+	file into an existing image, which may come from BMP_Create,
+	BMP_ReadFile or an earlier call. Its palette and pixel
+	buffers are reused when they are large enough, so reading
+	a sequence of images of one size allocates nothing after
+	the first one. On failure the image keeps its buffers and
+	may only be read into again or freed.
+**************************************************************/
+BMP_STATUS BMP_ReadStreamInto_r( FILE* f, BMP* bmp )
+{
+	BMP		loaded;
+	UINT	palettesize = 0;
+
+	if ( f == NULL || bmp == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
-		free( bmp );
-		return NULL;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 
-	/* Read header */
-	if ( ReadHeader( bmp, f ) != BMP_OK || bmp->Header.Magic != 0x4D42 )
+	/* Read header. The image only takes it once the buffers fit it. */
+	if ( ReadHeader( &loaded, f ) != BMP_OK || loaded.Header.Magic != 0x4D42 )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
-		fclose( f );
-		free( bmp );
-		return NULL;
+		return BMP_FILE_INVALID;
 	}
 
-	if ( bmp->Header.BitsPerPixel == 8 ) palettesize = BMP_PALETTE_SIZE_8bpp; 
-	if ( bmp->Header.BitsPerPixel == 4 ) palettesize = BMP_PALETTE_SIZE_4bpp;
+	if ( loaded.Header.BitsPerPixel == 8 ) palettesize = BMP_PALETTE_SIZE_8bpp;
+	if ( loaded.Header.BitsPerPixel == 4 ) palettesize = BMP_PALETTE_SIZE_4bpp;
 
 	/* Verify that the bitmap variant is supported */
-	if ( ( bmp->Header.BitsPerPixel != 32 && bmp->Header.BitsPerPixel != 24 
-		&& bmp->Header.BitsPerPixel != 8 && bmp->Header.BitsPerPixel != 4 )
-		|| bmp->Header.CompressionType != 0 || bmp->Header.HeaderSize != 40 )
+	if ( ( loaded.Header.BitsPerPixel != 32 && loaded.Header.BitsPerPixel != 24
+		&& loaded.Header.BitsPerPixel != 8 && loaded.Header.BitsPerPixel != 4 )
+		|| loaded.Header.CompressionType != 0 || loaded.Header.HeaderSize != 40 )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
-		fclose( f );
-		free( bmp );
-		return NULL;
+		return BMP_FILE_NOT_SUPPORTED;
 	}
 
 
-	/* Allocate and read palette */
-	if ( palettesize > 0 )
+	/* Make room for the palette and the pixels. An image without a palette
+	   must not keep the one of an earlier image, the pixel calls check it. */
+	if ( palettesize == 0 )
 	{
-		bmp->Palette = (UCHAR*) malloc( palettesize * sizeof( UCHAR ) );
-		if ( bmp->Palette == NULL )
-		{
-			BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
-			fclose( f );
-			free( bmp );
-			return NULL;
-		}
-
-		if ( fread( bmp->Palette, sizeof( UCHAR ), palettesize, f ) != palettesize )
-		{
-			BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
-			fclose( f );
-			free( bmp->Palette );
-			free( bmp );
-			return NULL;
-		}
+		free( bmp->Palette );
+		bmp->Palette = NULL;
+		bmp->PaletteCapacity = 0;
 	}
-	else	/* Not an indexed image */
+	else if ( ReserveBuffer( &bmp->Palette, &bmp->PaletteCapacity, palettesize ) != BMP_OK )
 	{
-		bmp->Palette = NULL;
+		return BMP_OUT_OF_MEMORY;
 	}
 
+	if ( ReserveBuffer( &bmp->Data, &bmp->DataCapacity, loaded.Header.ImageDataSize ) != BMP_OK )
+	{
+		return BMP_OUT_OF_MEMORY;
+	}
 
-	/* Allocate memory for image data */
-	bmp->Data = (UCHAR*) malloc( bmp->Header.ImageDataSize );
-	if ( bmp->Data == NULL )
+	bmp->Header = loaded.Header;
+
+
+	/* Read palette */
+	if ( palettesize > 0 && fread( bmp->Palette, sizeof( UCHAR ), palettesize, f ) != palettesize )
 	{
-		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
-		fclose( f );
-		free( bmp->Palette );
-		free( bmp );
-		return NULL;
+		return BMP_FILE_INVALID;
 	}
 
 
 	/* Read image data */
 	if ( fread( bmp->Data, sizeof( UCHAR ), bmp->Header.ImageDataSize, f ) != bmp->Header.ImageDataSize )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
-		fclose( f );
-		free( bmp->Data );
-		free( bmp->Palette );
-		free( bmp );
-		return NULL;
+		return BMP_FILE_INVALID;
 	}
 
+	return BMP_OK;
+}
 
-	fclose( f );
 
-	BMP_LAST_ERROR_CODE = BMP_OK;
+/**************************************************************
+	Reads the specified BMP image file into an existing image,
+	see BMP_ReadStreamInto_r().
+**************************************************************/
+BMP_STATUS BMP_ReadFileInto_r( const char* filename, BMP* bmp )
+{
+	FILE*		f;
+	BMP_STATUS	status;
 
-	return bmp;
+	if ( filename == NULL || bmp == NULL )
+	{
+		return BMP_INVALID_ARGUMENT;
+	}
+
+
+	/* Open file */
+	f = fopen( filename, "rb" );
+	if ( f == NULL )
+	{
+		return BMP_FILE_NOT_FOUND;
+	}
+
+	status = BMP_ReadStreamInto_r( f, bmp );
+
+	fclose( f );
+
+	return status;
 }
 
 
 /**************************************************************
-	Writes the BMP image to the specified file.
+	Reads the specified BMP image file.
 **************************************************************/
-void BMP_WriteFile( BMP* bmp, const char* filename )
+BMP_STATUS BMP_ReadFile_r( const char* filename, BMP** result )
 {
-	FILE*	f;
-	UINT	palettesize = 0;
+	BMP*		bmp;
+	BMP_STATUS	status;
 
-	if ( bmp->Header.BitsPerPixel == 8 ) palettesize = BMP_PALETTE_SIZE_8bpp; 
-	if ( bmp->Header.BitsPerPixel == 4 ) palettesize = BMP_PALETTE_SIZE_4bpp;
+	if ( result != NULL )
+	{
+		*result = NULL;
+	}
 
-	if ( filename == NULL )
+	if ( filename == NULL || result == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
-		return;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 
-	/* Open file */
-	f = fopen( filename, "wb" );
-	if ( f == NULL )
+	/* Allocate */
+	bmp = (BMP*)calloc( 1, sizeof( BMP ) );
+	if ( bmp == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
-		return;
+		return BMP_OUT_OF_MEMORY;
 	}
 
 
+	/* Read into the empty image */
+	status = BMP_ReadFileInto_r( filename, bmp );
+	if ( status != BMP_OK )
+	{
+		free( bmp->Data );
+		free( bmp->Palette );
+		free( bmp );
+		return status;
+	}
+
+	*result = bmp;
+
+	return BMP_OK;
+}
+
+
+/**************************************************************
+	Writes the BMP image at the current position of an open
+	file, which is left open. Nothing is allocated.
+**************************************************************/
+BMP_STATUS BMP_WriteStream_r( BMP* bmp, FILE* f )
+{
+	UINT	palettesize = 0;
+
+	if ( bmp == NULL || f == NULL )
+	{
+		return BMP_INVALID_ARGUMENT;
+	}
+
+	if ( bmp->Header.BitsPerPixel == 8 ) palettesize = BMP_PALETTE_SIZE_8bpp;
+	if ( bmp->Header.BitsPerPixel == 4 ) palettesize = BMP_PALETTE_SIZE_4bpp;
+
+
 	/* Write header */
 	if ( WriteHeader( bmp, f ) != BMP_OK )
 	{
-		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
-		fclose( f );
-		return;
+		return BMP_IO_ERROR;
 	}
 
 
@@ -360,9 +422,7 @@ void BMP_WriteFile( BMP* bmp, const char* filename )
 	{
 		if ( fwrite( bmp->Palette, sizeof( UCHAR ), palettesize, f ) != palettesize )
 		{
-			BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
-			fclose( f );
-			return;
+			return BMP_IO_ERROR;
 		}
 	}
 
@@ -370,14 +430,42 @@ void BMP_WriteFile( BMP* bmp, const char* filename )
 	/* Write data */
 	if ( fwrite( bmp->Data, sizeof( UCHAR ), bmp->Header.ImageDataSize, f ) != bmp->Header.ImageDataSize )
 	{
-		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
-		fclose( f );
-		return;
+		return BMP_IO_ERROR;
 	}
 
+	return BMP_OK;
+}
 
-	BMP_LAST_ERROR_CODE = BMP_OK;
-	fclose( f );
+
+/**************************************************************
+	Writes the BMP image to the specified file.
+**************************************************************/
+BMP_STATUS BMP_WriteFile_r( BMP* bmp, const char* filename )
+{
+	FILE*		f;
+	BMP_STATUS	status;
+
+	if ( bmp == NULL || filename == NULL )
+	{
+		return BMP_INVALID_ARGUMENT;
+	}
+
+
+	/* Open file */
+	f = fopen( filename, "wb" );
+	if ( f == NULL )
+	{
+		return BMP_FILE_NOT_FOUND;
+	}
+
+	status = BMP_WriteStream_r( bmp, f );
+
+	if ( fclose( f ) != 0 && status == BMP_OK )
+	{
+		return BMP_IO_ERROR;
+	}
+
+	return status;
 }
 
 
@@ -436,7 +524,7 @@ USHORT BMP_GetDepth( BMP* bmp )
 	Populates the arguments with the specified pixel's RGB
 	values.
 **************************************************************/
-void BMP_GetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
+BMP_STATUS BMP_GetPixelRGB_r( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
 {
 	UCHAR*	pixel;
 	UINT	bytes_per_row;
@@ -444,12 +532,10 @@ void BMP_GetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
 
 	if ( bmp == NULL || x < 0 || x >= bmp->Header.Width || y < 0 || y >= bmp->Header.Height )
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 	else
 	{
-		BMP_LAST_ERROR_CODE = BMP_OK;
-
 		bytes_per_pixel = bmp->Header.BitsPerPixel >> 3;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
@@ -470,13 +556,15 @@ void BMP_GetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
 		if ( g )	*g = *( pixel + 1 );
 		if ( b )	*b = *( pixel + 0 );
 	}
+
+	return BMP_OK;
 }
 
 
 /**************************************************************
 	Sets the specified pixel's RGB values.
 **************************************************************/
-void BMP_SetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
+BMP_STATUS BMP_SetPixelRGB_r( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
 {
 	UCHAR*	pixel;
 	UINT	bytes_per_row;
@@ -484,18 +572,16 @@ void BMP_SetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
 
 	if ( bmp == NULL || x < 0 || x >= bmp->Header.Width || y < 0 || y >= bmp->Header.Height )
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	else if ( bmp->Palette != NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_TYPE_MISMATCH;
+		return BMP_TYPE_MISMATCH;
 	}
 
 	else
 	{
-		BMP_LAST_ERROR_CODE = BMP_OK;
-
 		bytes_per_pixel = bmp->Header.BitsPerPixel >> 3;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
@@ -509,13 +595,15 @@ void BMP_SetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
 		*( pixel + 1 ) = g;
 		*( pixel + 0 ) = b;
 	}
+
+	return BMP_OK;
 }
 
 
 /**************************************************************
 	Gets the specified pixel's color index.
 **************************************************************/
-void BMP_GetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR* val )
+BMP_STATUS BMP_GetPixelIndex_r( BMP* bmp, UINT x, UINT y, UCHAR* val )
 {
 	UCHAR*	pixel;
 	UINT	bytes_per_row;
@@ -523,18 +611,16 @@ void BMP_GetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR* val )
 
 	if ( bmp == NULL || x < 0 || x >= bmp->Header.Width || y < 0 || y >= bmp->Header.Height || val == NULL)
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	else if ( bmp->Palette == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_TYPE_MISMATCH;
+		return BMP_TYPE_MISMATCH;
 	}
 
 	else
 	{
-		BMP_LAST_ERROR_CODE = BMP_OK;
-
 		/* Row's size is rounded up to the next multiple of 4 bytes */
 		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
 
@@ -557,13 +643,15 @@ void BMP_GetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR* val )
 				*val = (*pixel & 0xF0) / 0x10;
 		}
 	}
+
+	return BMP_OK;
 }
 
 
 /**************************************************************
 	Sets the specified pixel's color index.
 **************************************************************/
-void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
+BMP_STATUS BMP_SetPixelIndex_r( BMP* bmp, UINT x, UINT y, UCHAR val )
 {
 	UCHAR*	pixel;
 	UINT	bytes_per_row;
@@ -572,18 +660,16 @@ void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
 	if  (bmp == NULL || x >= bmp->Header.Width || y >= bmp->Header.Height ||
 		(bmp->Header.BitsPerPixel == 4 && val >= 16))
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	else if ( bmp->Palette == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_TYPE_MISMATCH;
+		return BMP_TYPE_MISMATCH;
 	}
 
 	else
 	{
-		BMP_LAST_ERROR_CODE = BMP_OK;
-
 		/* Row's size is rounded up to the next multiple of 4 bytes */
 		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
 		
@@ -614,23 +700,25 @@ void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
 		
 		
 	}
+
+	return BMP_OK;
 }
 
 
 /**************************************************************
 	Gets the color value for the specified palette index.
 **************************************************************/
-void BMP_GetPaletteColor( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b )
+BMP_STATUS BMP_GetPaletteColor_r( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b )
 {
 	if  (bmp == NULL || 
 		(bmp->Header.BitsPerPixel == 4 && index >= 16))
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	else if ( bmp->Palette == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_TYPE_MISMATCH;
+		return BMP_TYPE_MISMATCH;
 	}
 
 	else
@@ -638,26 +726,26 @@ void BMP_GetPaletteColor( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b )
 		if ( r )	*r = *( bmp->Palette + index * 4 + 2 );
 		if ( g )	*g = *( bmp->Palette + index * 4 + 1 );
 		if ( b )	*b = *( bmp->Palette + index * 4 + 0 );
-
-		BMP_LAST_ERROR_CODE = BMP_OK;
 	}
+
+	return BMP_OK;
 }
 
 
 /**************************************************************
 	Sets the color value for the specified palette index.
 **************************************************************/
-void BMP_SetPaletteColor( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b )
+BMP_STATUS BMP_SetPaletteColor_r( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b )
 {
 	if  (bmp == NULL || 
 		(bmp->Header.BitsPerPixel == 4 && index >= 16))
 	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
 	}
 
 	else if ( bmp->Palette == NULL )
 	{
-		BMP_LAST_ERROR_CODE = BMP_TYPE_MISMATCH;
+		return BMP_TYPE_MISMATCH;
 	}
 
 	else
@@ -665,9 +753,91 @@ void BMP_SetPaletteColor( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b )
 		*( bmp->Palette + index * 4 + 2 ) = r;
 		*( bmp->Palette + index * 4 + 1 ) = g;
 		*( bmp->Palette + index * 4 + 0 ) = b;
-
-		BMP_LAST_ERROR_CODE = BMP_OK;
 	}
+
+	return BMP_OK;
+}
+
+
+/**************************************************************
+	The original API. Each call stores its status as the last
+	error code of the calling thread, see BMP_GetError().
+**************************************************************/
+BMP* BMP_Create( UINT width, UINT height, USHORT depth )
+{
+	BMP*	bmp;
+
+	BMP_LAST_ERROR_CODE = BMP_Create_r( width, height, depth, &bmp );
+	return bmp;
+}
+
+
+BMP* BMP_ReadFile( const char* filename )
+{
+	BMP*	bmp;
+
+	BMP_LAST_ERROR_CODE = BMP_ReadFile_r( filename, &bmp );
+	return bmp;
+}
+
+
+void BMP_WriteFile( BMP* bmp, const char* filename )
+{
+	BMP_LAST_ERROR_CODE = BMP_WriteFile_r( bmp, filename );
+}
+
+
+void BMP_ReadFileInto( const char* filename, BMP* bmp )
+{
+	BMP_LAST_ERROR_CODE = BMP_ReadFileInto_r( filename, bmp );
+}
+
+
+void BMP_ReadStreamInto( FILE* f, BMP* bmp )
+{
+	BMP_LAST_ERROR_CODE = BMP_ReadStreamInto_r( f, bmp );
+}
+
+
+void BMP_WriteStream( BMP* bmp, FILE* f )
+{
+	BMP_LAST_ERROR_CODE = BMP_WriteStream_r( bmp, f );
+}
+
+
+void BMP_GetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
+{
+	BMP_LAST_ERROR_CODE = BMP_GetPixelRGB_r( bmp, x, y, r, g, b );
+}
+
+
+void BMP_SetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
+{
+	BMP_LAST_ERROR_CODE = BMP_SetPixelRGB_r( bmp, x, y, r, g, b );
+}
+
+
+void BMP_GetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR* val )
+{
+	BMP_LAST_ERROR_CODE = BMP_GetPixelIndex_r( bmp, x, y, val );
+}
+
+
+void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
+{
+	BMP_LAST_ERROR_CODE = BMP_SetPixelIndex_r( bmp, x, y, val );
+}
+
+
+void BMP_GetPaletteColor( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b )
+{
+	BMP_LAST_ERROR_CODE = BMP_GetPaletteColor_r( bmp, index, r, g, b );
+}
+
+
+void BMP_SetPaletteColor( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b )
+{
+	BMP_LAST_ERROR_CODE = BMP_SetPaletteColor_r( bmp, index, r, g, b );
 }
 
 
@@ -685,9 +855,19 @@ BMP_STATUS BMP_GetError()
 **************************************************************/
 const char* BMP_GetErrorDescription()
 {
-	if ( BMP_LAST_ERROR_CODE > 0 && BMP_LAST_ERROR_CODE < BMP_ERROR_NUM )
+	return BMP_GetStatusDescription( BMP_LAST_ERROR_CODE );
+}
+
+
+/**************************************************************
+	Returns a description of the specified status, or NULL
+	for BMP_OK.
+**************************************************************/
+const char* BMP_GetStatusDescription( BMP_STATUS status )
+{
+	if ( status > 0 && status < BMP_ERROR_NUM )
 	{
-		return BMP_ERROR_STRING[ BMP_LAST_ERROR_CODE ];
+		return BMP_ERROR_STRING[ status ];
 	}
 	else
 	{
@@ -99,6 +99,15 @@ BMP*			BMP_ReadFile				( const char* filename );
 void			BMP_WriteFile				( BMP* bmp, const char* filename );
 
 
+/* I/O with an existing image: its buffers are reused when they are large
+   enough, so a sequence of equally sized images is read and written without
+   allocations once the first one is in. The stream variants leave the file
+   open and at the position after the image. */
+void			BMP_ReadFileInto			( const char* filename, BMP* bmp );
+void			BMP_ReadStreamInto			( FILE* f, BMP* bmp );
+void			BMP_WriteStream				( BMP* bmp, FILE* f );
+
+
 /* Meta info */
 UINT			BMP_GetWidth				( BMP* bmp );
 UINT			BMP_GetHeight				( BMP* bmp );
@@ -117,9 +126,27 @@ void			BMP_GetPaletteColor			( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR*
 void			BMP_SetPaletteColor			( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b );
 
 
-/* Error handling */
+/* Error handling. The last error code is kept per thread. */
 BMP_STATUS		BMP_GetError				();
 const char*		BMP_GetErrorDescription		();
+const char*		BMP_GetStatusDescription	( BMP_STATUS status );
+
+
+/* Reentrant variants: they return the status instead of storing it as the last
+   error code, so threads working on their own images share no state at all.
+   The images are returned through the BMP** arguments (NULL on failure). */
+BMP_STATUS		BMP_Create_r				( UINT width, UINT height, USHORT depth, BMP** bmp );
+BMP_STATUS		BMP_ReadFile_r				( const char* filename, BMP** bmp );
+BMP_STATUS		BMP_WriteFile_r				( BMP* bmp, const char* filename );
+BMP_STATUS		BMP_ReadFileInto_r			( const char* filename, BMP* bmp );
+BMP_STATUS		BMP_ReadStreamInto_r		( FILE* f, BMP* bmp );
+BMP_STATUS		BMP_WriteStream_r			( BMP* bmp, FILE* f );
+BMP_STATUS		BMP_GetPixelRGB_r			( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b );
+BMP_STATUS		BMP_SetPixelRGB_r			( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b );
+BMP_STATUS		BMP_GetPixelIndex_r			( BMP* bmp, UINT x, UINT y, UCHAR* val );
+BMP_STATUS		BMP_SetPixelIndex_r			( BMP* bmp, UINT x, UINT y, UCHAR val );
+BMP_STATUS		BMP_GetPaletteColor_r		( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b );
+BMP_STATUS		BMP_SetPaletteColor_r		( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b );
 
 
 /* Useful macro that may be used after each BMP operation to check for an error */
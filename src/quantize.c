@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bmp_header.h"
+#include "convert.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "quantize.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define QUANTIZE_BITS     5       //Bits of every channel told apart by the histogram and the lookup grid
+#define QUANTIZE_SIDE     (1 << QUANTIZE_BITS)
+#define QUANTIZE_CELLS     (QUANTIZE_SIDE * QUANTIZE_SIDE * QUANTIZE_SIDE)
+#define QUANTIZE_SAMPLE_BYTES     (32 << 20)      //Pixel rows read for the histogram at most
+#define QUANTIZE_BAND_BYTES     (1 << 20)
+
+//Cell of the pixel at p (blue, green, red), blue in the high bits
+#define COLOR_CELL(p)     ((p)[0] >> (8 - QUANTIZE_BITS) << 2 * QUANTIZE_BITS | \
+                           (p)[1] >> (8 - QUANTIZE_BITS) << QUANTIZE_BITS | (p)[2] >> (8 - QUANTIZE_BITS))
+#define CELL_OF(blue, green, red)     ((blue) << 2 * QUANTIZE_BITS | (green) << QUANTIZE_BITS | (red))
+
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum[3];        //Of the blue, green and red values of the pixels in the cell
+} histogram_cell;
+
+//Box of cells split by the median cut, bounds included
+typedef struct {
+    uint8_t low[3];
+    uint8_t high[3];
+    uint64_t count;
+} color_box;
+
+//The share of one worker thread in a pass: rows of the image or cells of the grid
+typedef struct quantize_job {
+    void (*work) (struct quantize_job *job);
+    int input_fd;
+    int output_fd;
+    const uint32_t *header;
+    const uint32_t *result_header;
+    unsigned int first;     //Row first * step is read first, then every step-th row
+    unsigned int count;
+    unsigned int step;
+    histogram_cell *cells;      //The private histogram, or the summed one while the grid is filled
+    const uint8_t *palette;
+    unsigned int colors;
+    uint8_t *grid;      //Palette index of every cell
+    int result;
+} quantize_job;
+
+
+static void *run_job (void *argument)
+{
+    quantize_job *job = argument;
+    job->work(job);
+    perf_counters_release_thread();
+    return NULL;
+}
+
+
+//Runs every job on a thread of its own. A job whose thread can not be started runs on the calling thread.
+static void run_jobs (quantize_job *jobs, unsigned int count)
+{
+    pthread_t threads[QUANTIZE_MAX_THREADS];
+    int started[QUANTIZE_MAX_THREADS];
+    for (unsigned int t = 0; t < count; t++)
+        started[t] = pthread_create(&threads[t], NULL, run_job, &jobs[t]) == 0;
+    for (unsigned int t = 0; t < count; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            jobs[t].work(&jobs[t]);
+    }
+}
+
+
+//Shares total rows (or cells) out to the jobs in contiguous runs
+static void share_out (quantize_job *jobs, unsigned int count, unsigned int total, void (*work) (quantize_job *job))
+{
+    for (unsigned int t = 0; t < count; t++) {
+        jobs[t].work = work;
+        jobs[t].first = (unsigned int)((unsigned long long)total * t / count);
+        jobs[t].count = (unsigned int)((unsigned long long)total * (t + 1) / count) - jobs[t].first;
+        jobs[t].result = 0;
+    }
+}
+
+
+static size_t source_row_bytes (const uint32_t *header)
+{
+    return (size_t)header[WIDTH_A] * 3 + header[WIDTH_A] % 4;
+}
+
+
+static unsigned int rows_per_band (size_t bytes_in_row, unsigned int step)
+{
+    //Sampled rows are not contiguous, they are read one by one
+    if (step != 1 || bytes_in_row > QUANTIZE_BAND_BYTES)
+        return 1;
+    return QUANTIZE_BAND_BYTES / bytes_in_row;
+}
+
+
+//Reads count rows of the job starting at its index-th row
+static int read_rows (const quantize_job *job, uint8_t *band, unsigned int index, unsigned int count)
+{
+    size_t source_row = source_row_bytes(job->header);
+    long long address = job->header[PIXEL_ARRAY_ADDRESS_A] + (long long)(job->first + index) * job->step * source_row;
+    perf_scope scope;
+    int result;
+    perf_phase_begin(&scope);
+    result = pread_full(job->input_fd, band, count * source_row, address);
+    perf_phase_end(&scope, PERF_PIXEL_READ, count * source_row);
+    if (result != 0) {
+        error(result > 0 ? "Pixel array read error. End of file." : "Pixel array read error.");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void build_histogram (quantize_job *job)
+{
+    unsigned int width = job->header[WIDTH_A], band_rows, count;
+    size_t source_row = source_row_bytes(job->header);
+    histogram_cell *cell;
+    uint8_t *band;
+    perf_scope scope;
+    band_rows = rows_per_band(source_row, job->step);
+    if ((band = malloc((size_t)band_rows * source_row + 1)) == NULL) {
+        error("Memory allocation error.");
+        job->result = -1;
+        return;
+    }
+    for (unsigned int i = 0; i < job->count; i += count) {
+        count = job->count - i < band_rows ? job->count - i : band_rows;
+        if (read_rows(job, band, i, count)) {
+            job->result = -1;
+            break;
+        }
+        perf_phase_begin(&scope);
+        for (unsigned int k = 0; k < count; k++)
+            for (const uint8_t *p = band + k * source_row; p < band + k * source_row + (size_t)width * 3; p += 3) {
+                cell = &job->cells[COLOR_CELL(p)];
+                cell->count++;
+                cell->sum[0] += p[0];
+                cell->sum[1] += p[1];
+                cell->sum[2] += p[2];
+            }
+        perf_phase_end(&scope, PERF_TRANSFORM, count * source_row);
+    }
+    free(band);
+}
+
+
+//Cuts box down to the cells of the histogram that hold pixels and counts them
+static void shrink_box (const histogram_cell *cells, color_box *box)
+{
+    uint8_t low[3] = { QUANTIZE_SIDE - 1, QUANTIZE_SIDE - 1, QUANTIZE_SIDE - 1 }, high[3] = { 0, 0, 0 };
+    uint8_t at[3];
+    box->count = 0;
+    for (at[0] = box->low[0]; at[0] <= box->high[0]; at[0]++)
+        for (at[1] = box->low[1]; at[1] <= box->high[1]; at[1]++)
+            for (at[2] = box->low[2]; at[2] <= box->high[2]; at[2]++) {
+                uint64_t count = cells[CELL_OF(at[0], at[1], at[2])].count;
+                if (count == 0)
+                    continue;
+                box->count += count;
+                for (int c = 0; c < 3; c++) {
+                    if (at[c] < low[c])
+                        low[c] = at[c];
+                    if (at[c] > high[c])
+                        high[c] = at[c];
+                }
+            }
+    memcpy(box->low, low, 3);
+    memcpy(box->high, high, 3);
+}
+
+
+//Splits box at the median of its pixels along its longest side into box and next
+static void split_box (const histogram_cell *cells, color_box *box, color_box *next)
+{
+    uint64_t plane[QUANTIZE_SIDE] = { 0 }, below = 0;
+    uint8_t at[3];
+    int axis = 0, cut;
+    for (int c = 1; c < 3; c++)
+        if (box->high[c] - box->low[c] > box->high[axis] - box->low[axis])
+            axis = c;
+    for (at[0] = box->low[0]; at[0] <= box->high[0]; at[0]++)
+        for (at[1] = box->low[1]; at[1] <= box->high[1]; at[1]++)
+            for (at[2] = box->low[2]; at[2] <= box->high[2]; at[2]++)
+                plane[at[axis]] += cells[CELL_OF(at[0], at[1], at[2])].count;
+    //Both halves keep pixels: the bounds of a shrunk box are occupied
+    for (cut = box->low[axis]; cut < box->high[axis] - 1; cut++)
+        if ((below += plane[cut]) * 2 >= box->count)
+            break;
+    *next = *box;
+    box->high[axis] = (uint8_t)cut;
+    next->low[axis] = (uint8_t)(cut + 1);
+    shrink_box(cells, box);
+    shrink_box(cells, next);
+}
+
+
+//Median cut of the histogram into at most colors boxes, whose mean colors become the palette.
+//Returns the number of palette entries.
+static unsigned int median_cut (const histogram_cell *cells, unsigned int colors, uint8_t *palette)
+{
+    color_box boxes[256];
+    unsigned int count = 1, widest;
+    uint64_t score, best, sum[3];
+    memset(boxes[0].low, 0, 3);
+    memset(boxes[0].high, QUANTIZE_SIDE - 1, 3);
+    shrink_box(cells, &boxes[0]);
+    if (boxes[0].count == 0)
+        return 0;
+    //The box with the most pixels spread the widest is split next
+    while (count < colors) {
+        best = 0;
+        widest = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            int extent = 0;
+            for (int c = 0; c < 3; c++)
+                if (boxes[i].high[c] - boxes[i].low[c] > extent)
+                    extent = boxes[i].high[c] - boxes[i].low[c];
+            score = boxes[i].count * extent;
+            if (score > best) {
+                best = score;
+                widest = i;
+            }
+        }
+        if (best == 0)
+            break;
+        split_box(cells, &boxes[widest], &boxes[count++]);
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        uint8_t at[3];
+        memset(sum, 0, sizeof(sum));
+        for (at[0] = boxes[i].low[0]; at[0] <= boxes[i].high[0]; at[0]++)
+            for (at[1] = boxes[i].low[1]; at[1] <= boxes[i].high[1]; at[1]++)
+                for (at[2] = boxes[i].low[2]; at[2] <= boxes[i].high[2]; at[2]++)
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += cells[CELL_OF(at[0], at[1], at[2])].sum[c];
+        for (int c = 0; c < 3; c++)
+            palette[4 * i + c] = (uint8_t)((sum[c] + boxes[i].count / 2) / boxes[i].count);
+        palette[4 * i + 3] = 0;
+    }
+    return count;
+}
+
+
+//Assigns the cells of the job their nearest palette entry, measured from the mean color of the sampled pixels
+//in the cell or from its center when the sample has none
+static void fill_grid (quantize_job *job)
+{
+    perf_scope scope;
+    perf_phase_begin(&scope);
+    for (unsigned int cell = job->first; cell < job->first + job->count; cell++) {
+        const histogram_cell *sample = &job->cells[cell];
+        int color[3], distance, nearest = 0, best = 1 << 30;
+        for (int c = 0; c < 3; c++) {
+            unsigned int value = cell >> (2 - c) * QUANTIZE_BITS & (QUANTIZE_SIDE - 1);
+            color[c] = sample->count ? (int)(sample->sum[c] / sample->count) :
+                       (int)(value << (8 - QUANTIZE_BITS) | 1 << (7 - QUANTIZE_BITS));
+        }
+        for (unsigned int i = 0; i < job->colors; i++) {
+            const uint8_t *entry = job->palette + 4 * i;
+            distance = (color[0] - entry[0]) * (color[0] - entry[0]) + (color[1] - entry[1]) * (color[1] - entry[1]) +
+                       (color[2] - entry[2]) * (color[2] - entry[2]);
+            if (distance < best) {
+                best = distance;
+                nearest = i;
+            }
+        }
+        job->grid[cell] = (uint8_t)nearest;
+    }
+    perf_phase_end(&scope, PERF_PALETTE, job->count);
+}
+
+
+static void map_rows (quantize_job *job)
+{
+    unsigned int width = job->header[WIDTH_A], band_rows, count;
+    size_t source_row = source_row_bytes(job->header), result_row = width + (4 - width % 4) % 4;
+    uint8_t *band, *result_band, *out;
+    perf_scope scope;
+    band_rows = rows_per_band(source_row, 1);
+    band = malloc((size_t)band_rows * source_row + 1);
+    //Zeroed once, so the padding of the result rows stays zero
+    result_band = calloc((size_t)band_rows * result_row + 1, 1);
+    if (band == NULL || result_band == NULL) {
+        error("Memory allocation error.");
+        free(band);
+        free(result_band);
+        job->result = -1;
+        return;
+    }
+    for (unsigned int i = 0; i < job->count; i += count) {
+        count = job->count - i < band_rows ? job->count - i : band_rows;
+        if (read_rows(job, band, i, count)) {
+            job->result = -1;
+            break;
+        }
+        perf_phase_begin(&scope);
+        for (unsigned int k = 0; k < count; k++) {
+            out = result_band + k * result_row;
+            for (const uint8_t *p = band + k * source_row; p < band + k * source_row + (size_t)width * 3; p += 3)
+                *out++ = job->grid[COLOR_CELL(p)];
+        }
+        perf_phase_end(&scope, PERF_TRANSFORM, count * source_row);
+        perf_phase_begin(&scope);
+        job->result = pwrite_full(job->output_fd, result_band, count * result_row,
+                                  job->result_header[PIXEL_ARRAY_ADDRESS_A] + (long long)(job->first + i) * result_row);
+        perf_phase_end(&scope, PERF_WRITE, count * result_row);
+        if (job->result != 0) {
+            error("Data writing error");
+            break;
+        }
+    }
+    free(band);
+    free(result_band);
+}
+
+
+static int jobs_failed (const quantize_job *jobs, unsigned int count)
+{
+    for (unsigned int t = 0; t < count; t++)
+        if (jobs[t].result != 0)
+            return -1;
+    return 0;
+}
+
+
+int convert_24bit_to_quantized (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options)
+{
+    quantize_job jobs[QUANTIZE_MAX_THREADS];
+    uint32_t result_header[HEADER_CELLS];
+    uint8_t palette[256 * 4] = { 0 }, grid[QUANTIZE_CELLS];
+    unsigned int rows = abs((signed)header[HEIGHT_A]), threads, step, samples, colors;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    histogram_cell *cells;
+    perf_scope scope;
+    int result;
+    indexed_header(header, options->palette_colors, result_header);
+    threads = online < 1 ? 1 : online > QUANTIZE_MAX_THREADS ? QUANTIZE_MAX_THREADS : (unsigned int)online;
+    if (threads > rows)
+        threads = rows ? rows : 1;
+    //Every step-th row is sampled, so the histogram reads QUANTIZE_SAMPLE_BYTES at most
+    step = (unsigned int)((unsigned long long)rows * source_row_bytes(header) / QUANTIZE_SAMPLE_BYTES + 1);
+    samples = (rows + step - 1) / step;
+    if ((cells = calloc((size_t)threads * QUANTIZE_CELLS, sizeof(histogram_cell))) == NULL) {
+        error("Memory allocation error.");
+        return -1;
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        jobs[t].input_fd = fileno(input_file);
+        jobs[t].output_fd = fileno(output_file);
+        jobs[t].header = header;
+        jobs[t].result_header = result_header;
+        jobs[t].step = step;
+        jobs[t].cells = cells + (size_t)t * QUANTIZE_CELLS;
+        jobs[t].palette = palette;
+        jobs[t].grid = grid;
+    }
+    share_out(jobs, threads, samples, build_histogram);
+    run_jobs(jobs, threads);
+    if (jobs_failed(jobs, threads)) {
+        free(cells);
+        return -1;
+    }
+    perf_phase_begin(&scope);
+    for (unsigned int t = 1; t < threads; t++)
+        for (unsigned int i = 0; i < QUANTIZE_CELLS; i++) {
+            cells[i].count += jobs[t].cells[i].count;
+            for (int c = 0; c < 3; c++)
+                cells[i].sum[c] += jobs[t].cells[i].sum[c];
+        }
+    colors = median_cut(cells, options->palette_colors, palette);
+    perf_phase_end(&scope, PERF_PALETTE, (size_t)threads * QUANTIZE_CELLS * sizeof(histogram_cell));
+    share_out(jobs, threads, QUANTIZE_CELLS, fill_grid);
+    for (unsigned int t = 0; t < threads; t++) {
+        jobs[t].cells = cells;
+        jobs[t].colors = colors;
+    }
+    run_jobs(jobs, threads);
+    free(cells);
+    //The grid holds indexes, so the tone operations only change the palette
+    apply_colors_palette(palette, colors, options);
+    perf_phase_begin(&scope);
+    result = write_8bit_head(output_file, result_header, palette);
+    perf_phase_end(&scope, PERF_WRITE, result_header[PIXEL_ARRAY_ADDRESS_A]);
+    if (result != 0)
+        return -1;
+    share_out(jobs, threads, rows, map_rows);
+    for (unsigned int t = 0; t < threads; t++)
+        jobs[t].step = 1;
+    run_jobs(jobs, threads);
+    return jobs_failed(jobs, threads);
+}
@@ -0,0 +1,16 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "convert.h"
+
+#define QUANTIZE_MAX_THREADS     16
+
+//--quantize <colors>: writes a 24-bit image as an 8-bit image with a palette of at most colors entries.
+//Worker threads build private color histograms of a row sample, which are summed and split by median cut.
+//Every cell of a 32x32x32 grid of colors is then assigned its nearest palette entry once, and the threads map
+//their rows through the grid. The tone operations are applied to the palette.
+int convert_24bit_to_quantized (FILE *input_file, uint32_t *header, FILE *output_file, const convert_options *options);
+
+#endif
@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "rle.h"
+
+#define RLE_MAX_COUNT     255
+#define RLE_MIN_LITERAL     3       //Absolute runs of 1 and 2 pixels are escape codes, so those are encoded runs
+
+
+//Length of the encoded run that starts at x. An RLE4 run repeats a pair of nibbles, so a,b,a,b... is a run as well.
+static unsigned int run_length (const uint8_t *row, unsigned int x, unsigned int width, int nibbles)
+{
+    unsigned int k = 1;
+    if (nibbles && x + 1 < width)
+        k = 2;
+    while (x + k < width && k < RLE_MAX_COUNT && row[x + k] == row[x + k % (nibbles ? 2 : 1)])
+        k++;
+    return k;
+}
+
+
+size_t rle_encode_row (const uint8_t *row, unsigned int width, int nibbles, int last, uint8_t *output)
+{
+    uint8_t *out = output;
+    unsigned int x = 0, run, end, count;
+    while (x < width) {
+        run = run_length(row, x, width, nibbles);
+        if (run < RLE_MIN_LITERAL) {
+            //Pixels that do not start a run of their own go to an absolute run
+            end = x + run;
+            while (end < width && end - x < RLE_MAX_COUNT && run_length(row, end, width, nibbles) < RLE_MIN_LITERAL)
+                end++;
+            count = end - x;
+            if (count >= RLE_MIN_LITERAL) {
+                *out++ = 0;
+                *out++ = count;
+                if (nibbles) {
+                    for (unsigned int k = 0; k < count; k += 2)
+                        *out++ = row[x + k] << 4 | (k + 1 < count ? row[x + k + 1] : 0);
+                }
+                else {
+                    for (unsigned int k = 0; k < count; k++)
+                        *out++ = row[x + k];
+                }
+                if ((out - output) % 2)     //Absolute runs end on a 16-bit boundary
+                    *out++ = 0;
+                x = end;
+                continue;
+            }
+        }
+        *out++ = run;
+        *out++ = nibbles ? row[x] << 4 | (run > 1 ? row[x + 1] : row[x]) : row[x];
+        x += run;
+    }
+    *out++ = 0;
+    *out++ = last ? 1 : 0;
+    return out - output;
+}
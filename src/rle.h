@@ -0,0 +1,19 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Values of the compression field of the header
+#define BMP_RLE8     1
+#define BMP_RLE4     2
+
+//Worst case size of one encoded row of width pixels, end of line included
+#define RLE_ROW_BOUND(width)     (2 * (size_t)(width) + 4)
+
+//Encodes one row of palette indexes (one byte per pixel) as BI_RLE8, or as BI_RLE4 when nibbles is set
+//(every index must then be below 16). The row ends with an end of line, or with the end of bitmap when last is set.
+//Returns the number of bytes written to output, at most RLE_ROW_BOUND(width).
+size_t rle_encode_row (const uint8_t *row, unsigned int width, int nibbles, int last, uint8_t *output);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ROW_KERNELS_H
+#define ROW_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Row kernels are generated at compile time for every bit depth, width % 4 residue and row order,
+//so the padding at the end of a row is a constant and the per-pixel loops have no end-of-row checks.
+//A kernel is picked once per image from a dispatch table: table[width % 4][top_down].
+//
+//A translation unit defines the per-row work as
+//  static inline int <name>_<depth> (uint8_t *first, const uint8_t *second, unsigned int width, unsigned int y, void *context)
+//where y is the row number counted from the top of the image, then instantiates it with DEFINE_ROW_KERNELS.
+//Converting kernels transform a row in place and do not care about the row order, so they are defined as
+//  static inline int <name>_<depth> (uint8_t *row, unsigned int width, void *context)
+//instantiated with DEFINE_CONVERT_ROW_KERNELS and picked from table[width % 4].
+//Every kernel returns 0 to go on or a non-zero code to stop.
+
+//Padding to the 4-byte boundary after a row of a width with the given residue
+#define ROW_PADDING(depth, residue)     ((depth) == 24 ? (residue) : (4 - (residue)) % 4)
+#define ROW_BYTES(depth, residue, width)     ((size_t)(width) * ((depth) / 8) + ROW_PADDING(depth, residue))
+#define ROW_Y(top_down, rows, row)     ((top_down) ? (row) : (rows) - 1 - (row))
+
+//Rows of the pixel array from first_row (in file order) on. second rows are second_step bytes apart,
+//negative when the second image stores its rows in the opposite order.
+typedef int (*row_kernel) (uint8_t *first, const uint8_t *second, long second_step,
+                           unsigned int count, unsigned int first_row, unsigned int width, unsigned int rows,
+                           void *context);
+
+#define DEFINE_ROW_KERNEL(name, depth, residue, top_down) \
+static int name##_##depth##_##residue##_##top_down (uint8_t *first, const uint8_t *second, long second_step, \
+                                                    unsigned int count, unsigned int first_row, unsigned int width, \
+                                                    unsigned int rows, void *context) \
+{ \
+    const size_t row_bytes = ROW_BYTES(depth, residue, width); \
+    int result = 0; \
+    for (unsigned int j = 0; j < count && result == 0; j++, first += row_bytes, second += second_step) \
+        result = name##_##depth(first, second, width, ROW_Y(top_down, rows, first_row + j), context); \
+    return result; \
+}
+
+//count rows from rows on
+typedef int (*convert_row_kernel) (uint8_t *rows, unsigned int count, unsigned int width, void *context);
+
+#define DEFINE_CONVERT_ROW_KERNEL(name, depth, residue) \
+static int name##_##depth##_##residue (uint8_t *rows, unsigned int count, unsigned int width, void *context) \
+{ \
+    const size_t row_bytes = ROW_BYTES(depth, residue, width); \
+    int result = 0; \
+    for (unsigned int j = 0; j < count && result == 0; j++, rows += row_bytes) \
+        result = name##_##depth(rows, width, context); \
+    return result; \
+}
+
+#define DEFINE_ROW_KERNELS(name, depth) \
+DEFINE_ROW_KERNEL(name, depth, 0, 0) DEFINE_ROW_KERNEL(name, depth, 0, 1) \
+DEFINE_ROW_KERNEL(name, depth, 1, 0) DEFINE_ROW_KERNEL(name, depth, 1, 1) \
+DEFINE_ROW_KERNEL(name, depth, 2, 0) DEFINE_ROW_KERNEL(name, depth, 2, 1) \
+DEFINE_ROW_KERNEL(name, depth, 3, 0) DEFINE_ROW_KERNEL(name, depth, 3, 1)
+
+#define ROW_KERNEL_TABLE(name, depth) { \
+    { name##_##depth##_0_0, name##_##depth##_0_1 }, \
+    { name##_##depth##_1_0, name##_##depth##_1_1 }, \
+    { name##_##depth##_2_0, name##_##depth##_2_1 }, \
+    { name##_##depth##_3_0, name##_##depth##_3_1 } }
+
+#define DEFINE_CONVERT_ROW_KERNELS(name, depth) \
+DEFINE_CONVERT_ROW_KERNEL(name, depth, 0) DEFINE_CONVERT_ROW_KERNEL(name, depth, 1) \
+DEFINE_CONVERT_ROW_KERNEL(name, depth, 2) DEFINE_CONVERT_ROW_KERNEL(name, depth, 3)
+
+#define CONVERT_ROW_KERNEL_TABLE(name, depth) { \
+    name##_##depth##_0, name##_##depth##_1, name##_##depth##_2, name##_##depth##_3 }
+
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "compare.h"
+#include "convert.h"
+#include "service.h"
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+#define SERVICE_WORKERS     4
+#define MAX_REQUEST_ARGUMENTS     64
+#define MAX_PASSED_FDS     2
+
+static int read_full (int fd, void *buffer, size_t size)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = recv(fd, buffer, size, 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        buffer = (char *)buffer + done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+static int write_full (int fd, const void *buffer, size_t size)
+{
+    ssize_t done;
+    while (size > 0) {
+        done = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        buffer = (const char *)buffer + done;
+        size -= done;
+    }
+    return 0;
+}
+
+
+//Receives the length prefix together with the descriptors passed alongside it, then the payload.
+//Returns 0 on success, 1 when the peer closed the connection and -1 on a malformed request.
+static int receive_request (int connection, char *payload, uint32_t *size, int *fds, int *fds_count)
+{
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct iovec iov = { size, sizeof(*size) };
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    ssize_t done;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    *fds_count = 0;
+    do
+        done = recvmsg(connection, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    while (done < 0 && errno == EINTR);
+    if (done == 0)
+        return 1;
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *fds_count);
+        }
+    }
+    if (done != sizeof(*size) || (message.msg_flags & MSG_CTRUNC) || *size == 0 || *size > SERVICE_MAX_REQUEST_SIZE)
+        return -1;
+    if (read_full(connection, payload, *size))
+        return -1;
+    return 0;
+}
+
+
+static int split_arguments (char *payload, uint32_t size, char **arguments)
+{
+    int count = 0;
+    uint32_t i = 0;
+    if (payload[size - 1] != '\0')
+        return -1;
+    while (i < size) {
+        if (count == MAX_REQUEST_ARGUMENTS)
+            return -1;
+        arguments[count++] = payload + i;
+        i += strlen(payload + i) + 1;
+    }
+    return count;
+}
+
+
+static int handle_request (char **arguments, int count, const int *fds, int fds_count)
+{
+    char fd_names[MAX_PASSED_FDS][32];
+    convert_options options;
+    compare_options comparison;
+    int files = 2;
+    if ((count < 4 || strcmp(arguments[0], "convert")) && (count < 3 || strcmp(arguments[0], "compare"))) {
+        error("Malformed service request.\n");
+        return -1;
+    }
+    //Both requests end with two file arguments
+    if (fds_count != 0) {
+        if (fds_count != files) {
+            error("Service request passes %d descriptors for %d files.\n", fds_count, files);
+            return -1;
+        }
+        for (int i = 0; i < files; i++) {
+            snprintf(fd_names[i], sizeof(fd_names[i]), "/proc/self/fd/%d", fds[i]);
+            arguments[count - files + i] = fd_names[i];
+        }
+    }
+    if (!strcmp(arguments[0], "compare")) {
+        if (parse_compare_arguments(count - 1, arguments + 1, &comparison))
+            return -2;
+        if (comparison.perf_counters) {
+            error("--perf-counters is not supported by the service.\n");
+            return -2;
+        }
+        return compare_files(&comparison);
+    }
+    if (parse_convert_arguments(count - 1, arguments + 1, &options))
+        return -1;
+    //The output can not be replaced by name, the conversion writes into the descriptor itself
+    if (fds_count != 0)
+        options.output_fd = fds[1];
+    //The counters would mix the phases of concurrent requests
+    if (options.perf_counters) {
+        error("--perf-counters is not supported by the service.\n");
+        return -1;
+    }
+    return convert_files(&options);
+}
+
+
+static void serve_connection (int connection, char *payload)
+{
+    char *arguments[MAX_REQUEST_ARGUMENTS];
+    int fds[MAX_PASSED_FDS], fds_count, count, result;
+    uint32_t size;
+    struct {
+        uint32_t size;
+        int32_t status;
+    } reply;
+    while ((result = receive_request(connection, payload, &size, fds, &fds_count)) != 1) {
+        if (result == 0 && (count = split_arguments(payload, size, arguments)) > 0)
+            reply.status = handle_request(arguments, count, fds, fds_count);
+        else {
+            error("Malformed service request.\n");
+            reply.status = -1;
+        }
+        for (int i = 0; i < fds_count; i++)
+            close(fds[i]);
+        reply.size = sizeof(reply.status);
+        if (result != 0 || write_full(connection, &reply, sizeof(reply)))
+            break;
+    }
+}
+
+
+static void *service_worker (void *argument)
+{
+    int listener = *(int *)argument, connection;
+    char *payload;
+    if ((payload = malloc(SERVICE_MAX_REQUEST_SIZE)) == NULL) {
+        error("Memory allocation error.");
+        return NULL;
+    }
+    for (;;) {
+        connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error("accept() error.");
+            break;
+        }
+        serve_connection(connection, payload);
+        close(connection);
+    }
+    free(payload);
+    return NULL;
+}
+
+
+static int fill_address (struct sockaddr_un *address, const char *socket_path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        error("Socket path is too long.");
+        return -1;
+    }
+    strcpy(address->sun_path, socket_path);
+    return 0;
+}
+
+
+int serve (const char *socket_path)
+{
+    struct sockaddr_un address;
+    struct stat status;
+    pthread_t workers[SERVICE_WORKERS];
+    int listener, started = 0;
+    if (fill_address(&address, socket_path))
+        return -1;
+    signal(SIGPIPE, SIG_IGN);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        error("socket() error.");
+        return -1;
+    }
+    //A socket left by a previous run would make bind() fail
+    if (lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, SOMAXCONN)) {
+        error("Can not listen on %s", socket_path);
+        close(listener);
+        return -1;
+    }
+    for (int i = 0; i < SERVICE_WORKERS; i++) {
+        if (pthread_create(&workers[started], NULL, service_worker, &listener) == 0)
+            started++;
+    }
+    if (started == 0) {
+        error("Thread creation error.");
+        close(listener);
+        return -1;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    close(listener);
+    unlink(socket_path);
+    return -1;
+}
+
+
+//The server opens every path but the two passed files itself, so a relative one is made absolute
+//against the directory of the client first
+static int append_argument (char *payload, uint32_t *size, const char *argument, int path)
+{
+    char directory[PATH_MAX];
+    size_t prefix = 0, length = strlen(argument);
+    if (path && argument[0] != '/') {
+        if (getcwd(directory, sizeof(directory)) == NULL) {
+            error("Can not resolve %s", argument);
+            return -1;
+        }
+        prefix = strlen(directory) + 1;
+    }
+    if (*size + prefix + length + 1 > SERVICE_MAX_REQUEST_SIZE) {
+        error("Service request is too long.");
+        return -1;
+    }
+    if (prefix != 0)
+        sprintf(payload + *size, "%s/", directory);
+    strcpy(payload + *size + prefix, argument);
+    *size += prefix + length + 1;
+    return 0;
+}
+
+
+int run_client (const char *socket_path, int argc, char **argv)
+{
+    struct sockaddr_un address;
+    char *payload, control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    int fds[MAX_PASSED_FDS], first_file, files = 0, passed, path, created = 0, connection = -1, result = -1;
+    uint32_t size = 0, reply_size;
+    int32_t status;
+    ssize_t sent;
+    struct iovec iov[2];
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    //Both requests end with two file arguments
+    if ((argc >= 4 && !strcmp(argv[0], "convert")) || (argc >= 3 && !strcmp(argv[0], "compare")))
+        first_file = argc - 2;
+    else {
+        error("Service requests are:\nconvert --mine|--theirs [options] <input_file>.bmp <output_file>.bmp\ncompare [options] <file1>.bmp <file2>.bmp");
+        return -1;
+    }
+    //An index holds the names of its images and is written by name, so its files are sent as names
+    passed = 2;
+    for (int i = 1; i < first_file; i++)
+        if (!strcmp(argv[0], "compare") && (!strcmp(argv[i], "--index-build") || !strcmp(argv[i], "--index-query")))
+            passed = 0;
+    if (fill_address(&address, socket_path) || (payload = malloc(SERVICE_MAX_REQUEST_SIZE)) == NULL)
+        return -1;
+    for (int i = 0; i < argc; i++) {
+        path = i >= first_file ? !passed : i > 1 && i < first_file &&
+               (!strcmp(argv[i - 1], "--preview") || !strcmp(argv[i - 1], "--mask"));
+        if (append_argument(payload, &size, argv[i], path))
+            goto cleanup;
+    }
+    for (; files < passed; files++) {
+        if (!strcmp(argv[0], "convert") && files == 1) {
+            //Not truncated: the server cuts the old contents off once the conversion has succeeded,
+            //and the input may be the same file (--region). A file created here is removed if it fails.
+            fds[files] = open(argv[first_file + files], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            if (fds[files] >= 0)
+                created = 1;
+            else if (errno == EEXIST)
+                fds[files] = open(argv[first_file + files], O_WRONLY | O_CLOEXEC);
+        }
+        else
+            fds[files] = open(argv[first_file + files], O_RDONLY | O_CLOEXEC);
+        if (fds[files] < 0) {
+            error("%s not found", argv[first_file + files]);
+            goto cleanup;
+        }
+    }
+    if ((connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(connection, (struct sockaddr *)&address, sizeof(address))) {
+        error("Can not connect to %s", socket_path);
+        goto cleanup;
+    }
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof(size);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    if (files != 0) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * files);
+        cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * files);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * files);
+    }
+    //The descriptors travel with the first byte, the rest of the frame may follow in further writes
+    if ((sent = sendmsg(connection, &message, MSG_NOSIGNAL)) < (ssize_t)sizeof(size) ||
+        write_full(connection, payload + (sent - sizeof(size)), size - (sent - sizeof(size)))) {
+        error("Can not send the request to %s", socket_path);
+        goto cleanup;
+    }
+    if (read_full(connection, &reply_size, sizeof(reply_size)) || reply_size != sizeof(status) ||
+        read_full(connection, &status, sizeof(status))) {
+        error("Malformed reply from %s", socket_path);
+        goto cleanup;
+    }
+    result = status;
+    //The server reports the reason on its own stderr
+    if (result < 0)
+        error("The service could not run the request (status %d).", result);
+cleanup:
+    if (connection >= 0)
+        close(connection);
+    for (int i = 0; i < files; i++)
+        close(fds[i]);
+    if (created && result != 0)
+        unlink(argv[first_file + 1]);
+    free(payload);
+    return result;
+}
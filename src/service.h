@@ -0,0 +1,19 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+//Protocol of the conversion service (local Unix stream socket, native byte order).
+//Request: uint32_t payload length, then the payload: NUL-terminated arguments, either
+//  "convert" followed by the converter arguments, or "compare" followed by the comparer arguments.
+//The last two arguments are files: paths, unless the request carries two file descriptors
+//(SCM_RIGHTS) in the same order, in which case the paths are used only as names.
+//Reply: uint32_t payload length (4), then int32_t status - the code the command line tool returns.
+#define SERVICE_MAX_REQUEST_SIZE     65536
+
+//Listens on socket_path and serves requests with a pool of worker threads. Returns -1 if the socket can not be set up.
+int serve (const char *socket_path);
+
+//Sends one request (argv as in the protocol above) to the service, passing the files as descriptors.
+//Returns the status from the reply, or -1 if the request could not be made.
+int run_client (const char *socket_path, int argc, char **argv);
+
+#endif